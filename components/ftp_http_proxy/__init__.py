@@ -1,45 +1,380 @@
+import re
+
 import esphome.codegen as cg
 import esphome.config_validation as cv
+from esphome.components import sensor
+from esphome.components.esp32 import add_idf_sdkconfig_option
+from esphome.const import STATE_CLASS_MEASUREMENT, UNIT_MILLISECOND
+from esphome.core import CORE
+from esphome.helpers import cpp_string_escape
 
 CONF_ID = 'id'  # Add this line to define CONF_ID
 CONF_SERVER = 'server'
 CONF_USERNAME = 'username'
 CONF_PASSWORD = 'password'
+CONF_PORT = 'port'
+CONF_TLS = 'tls'
+CONF_TLS_VERIFY = 'tls_verify'
+CONF_WEIGHT = 'weight'
+CONF_UPSTREAMS = 'upstreams'
+CONF_HEALTH_CHECK_INTERVAL = 'health_check_interval'
 CONF_REMOTE_PATHS = 'remote_paths'
 CONF_LOCAL_PORT = 'local_port'
+CONF_POOL_SIZE = 'pool_size'
+CONF_IDLE_TIMEOUT = 'idle_timeout'
+CONF_KEEPALIVE_INTERVAL = 'keepalive_interval'
+CONF_CONNECT_TIMEOUT = 'connect_timeout'
+CONF_DNS_TTL = 'dns_ttl'
+CONF_CHUNK_SIZE = 'chunk_size'
+CONF_BUFFER_COUNT = 'buffer_count'
+CONF_MAX_CONCURRENT = 'max_concurrent'
+CONF_QUEUE_SIZE = 'queue_size'
+CONF_CLIENT_RATE_LIMIT = 'client_rate_limit'
+CONF_GLOBAL_RATE_LIMIT = 'global_rate_limit'
+CONF_PRIORITIES = 'priorities'
+CONF_PATH = 'path'
+CONF_PRIORITY = 'priority'
+CONF_QUEUE_TIMEOUT = 'queue_timeout'
+CONF_COALESCE_BUFFER = 'coalesce_buffer'
+CONF_METADATA_TTL = 'metadata_ttl'
+CONF_DIRECTORIES = 'directories'
+CONF_LISTING_TTL = 'listing_ttl'
+CONF_MODE_Z = 'mode_z'
+CONF_MAX_RETRIES = 'max_retries'
+CONF_RETRY_BACKOFF = 'retry_backoff'
+CONF_ALLOW_UPLOAD = 'allow_upload'
+CONF_UPLOAD_CHUNK_SIZE = 'upload_chunk_size'
+CONF_PREFETCH = 'prefetch'
+CONF_REFRESH_INTERVAL = 'refresh_interval'
+CONF_PREFETCH_RAM_LIMIT = 'prefetch_ram_limit'
+CONF_PREFETCH_RAM_BUDGET = 'prefetch_ram_budget'
+CONF_STORAGE_COMPONENT = 'storage_component'
+CONF_CACHE_DIR = 'cache_dir'
+CONF_CACHE_TTL = 'cache_ttl'
+CONF_SEGMENTS = 'segments'
+CONF_SEGMENT_MIN_SIZE = 'segment_min_size'
+CONF_METRICS = 'metrics'
+CONF_TRACE_SIZE = 'trace_size'
+CONF_MIRROR = 'mirror'
+CONF_INTERVAL = 'interval'
+CONF_RATE_LIMIT = 'rate_limit'
+CONF_CHECKSUM = 'checksum'
+CONF_THROUGHPUT = 'throughput'
+CONF_FIRST_BYTE_TIME = 'first_byte_time'
 
 DEPENDENCIES = []
-AUTO_LOAD = []
+AUTO_LOAD = ['sensor']
 
 ftp_http_proxy_ns = cg.esphome_ns.namespace('ftp_http_proxy')
 FTPHTTPProxy = ftp_http_proxy_ns.class_('FTPHTTPProxy', cg.Component)
 
+# Composant storage (carte SD) utilisé comme cache, déclaré sans importer le module
+storage_ns = cg.esphome_ns.namespace('storage')
+StorageComponent = storage_ns.class_('StorageComponent', cg.Component)
+
+TransferPriority = ftp_http_proxy_ns.enum('TransferPriority')
+PRIORITIES = {
+    'bulk': TransferPriority.PRIORITY_BULK,
+    'normal': TransferPriority.PRIORITY_NORMAL,
+    'high': TransferPriority.PRIORITY_HIGH,
+}
+
 def validate_remote_paths(value):
     # Vérification personnalisée pour les chemins distants
     if not isinstance(value, list):
         raise cv.Invalid("Remote paths must be a list of strings")
-    return [cv.string(path) for path in value]
+    paths = [cv.string(path) for path in value]
+    for path in paths:
+        if '..' in path.split('/'):
+            raise cv.Invalid(f"Remote path must not contain '..': {path}")
+    return paths
 
-CONFIG_SCHEMA = cv.Schema({
-    cv.Required(CONF_ID): cv.declare_id(FTPHTTPProxy),  # Declare the ID for the component
+def validate_directory(value):
+    # Répertoire listable, sans '/' aux extrémités ("" : racine du compte FTP)
+    value = cv.string(value).strip('/')
+    if '..' in value.split('/'):
+        raise cv.Invalid(f"Directory must not contain '..': {value}")
+    return value
+
+def is_route_pattern(path):
+    return '*' in path or '?' in path
+
+def build_route_trie(patterns):
+    """Trie des préfixes littéraux des règles génériques, aplati en tableaux.
+
+    Renvoie (nœuds, arêtes, règles) : chaque nœud référence ses arêtes triées
+    par caractère et les règles dont le préfixe littéral se termine sur lui.
+    """
+    nodes = [{'children': {}, 'rules': []}]
+    for pattern in patterns:
+        literal = re.split(r'[*?]', pattern, maxsplit=1)[0]
+        node = 0
+        for ch in literal.encode():
+            child = nodes[node]['children'].get(ch)
+            if child is None:
+                child = len(nodes)
+                nodes.append({'children': {}, 'rules': []})
+                nodes[node]['children'][ch] = child
+            node = child
+        nodes[node]['rules'].append((pattern, len(literal.encode())))
+
+    flat_nodes, edges, rules = [], [], []
+    for node in nodes:
+        flat_nodes.append((len(edges), len(node['children']), len(rules), len(node['rules'])))
+        edges.extend(sorted(node['children'].items()))
+        rules.extend(node['rules'])
+    return flat_nodes, edges, rules
+
+def emit_route_table(var, name, patterns):
+    """Déclare la table de routage en constantes globales (flash) et la passe au composant."""
+    nodes, edges, rules = build_route_trie(patterns)
+    ns = 'esphome::ftp_http_proxy'
+    # Un tableau vide n'est pas du C++ valide : arête sentinelle jamais référencée
+    edges = edges or [(0, 0)]
+    cg.add_global(cg.RawStatement(
+        f"static const {ns}::RouteNode {name}_route_nodes[] = {{"
+        + ', '.join(f'{{{e}, {ec}, {r}, {rc}}}' for e, ec, r, rc in nodes) + '};'))
+    cg.add_global(cg.RawStatement(
+        f"static const {ns}::RouteEdge {name}_route_edges[] = {{"
+        + ', '.join(f'{{{ch}, {node}}}' for ch, node in edges) + '};'))
+    cg.add_global(cg.RawStatement(
+        f"static const {ns}::RouteRule {name}_route_rules[] = {{"
+        + ', '.join(f'{{{cpp_string_escape(pattern)}, {prefix}}}' for pattern, prefix in rules) + '};'))
+    cg.add(var.set_route_table(
+        cg.RawExpression(f'{name}_route_nodes'),
+        cg.RawExpression(f'{name}_route_edges'),
+        cg.RawExpression(f'{name}_route_rules')))
+
+PRIORITY_SCHEMA = cv.Schema({
+    cv.Required(CONF_PATH): cv.string,
+    cv.Required(CONF_PRIORITY): cv.enum(PRIORITIES, lower=True),
+})
+
+UPSTREAM_SCHEMA = cv.Schema({
     cv.Required(CONF_SERVER): cv.string,
-    cv.Required(CONF_USERNAME): cv.string,
-    cv.Required(CONF_PASSWORD): cv.string,
+    cv.Optional(CONF_PORT, default=21): cv.port,
+    cv.Optional(CONF_USERNAME): cv.string,
+    cv.Optional(CONF_PASSWORD): cv.string,
+    cv.Optional(CONF_WEIGHT, default=1): cv.int_range(min=1, max=100),
+})
+
+MIRROR_SCHEMA = cv.Schema({
+    cv.Required(CONF_DIRECTORIES): cv.ensure_list(validate_directory),
+    cv.Optional(CONF_PATH, default='/ftp_mirror'): cv.string,
+    cv.Optional(CONF_INTERVAL, default='1h'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_RATE_LIMIT, default=0): cv.int_range(min=0),
+    cv.Optional(CONF_CHECKSUM, default=False): cv.boolean,
+})
+
+def validate_mirror(config):
+    # Le miroir écrit sur la carte SD : storage_component est indispensable
+    if CONF_MIRROR in config and CONF_STORAGE_COMPONENT not in config:
+        raise cv.Invalid(f"'{CONF_MIRROR}' requires '{CONF_STORAGE_COMPONENT}'")
+    return config
+
+# Sockets lwIP réservés aux autres composants (API, OTA, mDNS, logger...)
+OTHER_SOCKETS = 4
+# Valeur figée de CONFIG_LWIP_MAX_SOCKETS dans les bibliothèques Arduino précompilées
+ARDUINO_MAX_SOCKETS = 16
+# Plafond de CONFIG_LWIP_MAX_SOCKETS côté ESP-IDF
+IDF_MAX_SOCKETS = 253
+
+def http_sockets(config):
+    # Un socket par transfert en cours et par requête en file, plus un pour
+    # répondre 503 quand la file est pleine et deux pour /status et /metrics
+    return config[CONF_MAX_CONCURRENT] + config[CONF_QUEUE_SIZE] + 3
+
+def lwip_sockets(config):
+    # httpd_start réserve 3 sockets internes ; le pool FTP tient un socket de
+    # contrôle et un de données par session, plus la sonde de santé
+    return http_sockets(config) + 3 + 2 * config[CONF_POOL_SIZE] + 1 + OTHER_SOCKETS
+
+def validate_sockets(config):
+    needed = lwip_sockets(config)
+    limit = ARDUINO_MAX_SOCKETS if CORE.using_arduino else IDF_MAX_SOCKETS
+    if needed > limit:
+        raise cv.Invalid(f"'{CONF_MAX_CONCURRENT}' + '{CONF_QUEUE_SIZE}' + 2 x '{CONF_POOL_SIZE}' need {needed} "
+                         f"lwIP sockets, more than the {limit} available on this framework")
+    return config
+
+def validate_upstreams(config):
+    """Regroupe server/port et upstreams en une seule liste d'amonts.
+
+    Les identifiants de premier niveau servent de valeur par défaut à chaque amont.
+    """
+    upstreams = []
+    if CONF_SERVER in config:
+        upstreams.append({CONF_SERVER: config[CONF_SERVER], CONF_PORT: config[CONF_PORT], CONF_WEIGHT: 1})
+    upstreams.extend(config.get(CONF_UPSTREAMS, []))
+    if not upstreams:
+        raise cv.Invalid(f"At least one of '{CONF_SERVER}' or '{CONF_UPSTREAMS}' is required")
+    if len(upstreams) > 8:
+        raise cv.Invalid("At most 8 upstream servers are supported")
+    for upstream in upstreams:
+        for key in (CONF_USERNAME, CONF_PASSWORD):
+            if key not in upstream:
+                if key not in config:
+                    raise cv.Invalid(f"Missing '{key}' for upstream {upstream[CONF_SERVER]}")
+                upstream[key] = config[key]
+    config[CONF_UPSTREAMS] = upstreams
+    return config
+
+CONFIG_SCHEMA = cv.All(cv.Schema({
+    cv.Required(CONF_ID): cv.declare_id(FTPHTTPProxy),  # Declare the ID for the component
+    cv.Optional(CONF_SERVER): cv.string,
+    cv.Optional(CONF_PORT, default=21): cv.port,
+    cv.Optional(CONF_USERNAME): cv.string,
+    cv.Optional(CONF_PASSWORD): cv.string,
+    cv.Optional(CONF_UPSTREAMS): cv.ensure_list(UPSTREAM_SCHEMA),
+    cv.Optional(CONF_HEALTH_CHECK_INTERVAL, default='30s'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_TLS, default=False): cv.boolean,
+    cv.Optional(CONF_TLS_VERIFY, default=True): cv.boolean,
     cv.Required(CONF_REMOTE_PATHS): validate_remote_paths,
     cv.Optional(CONF_LOCAL_PORT, default=8000): cv.port,
-})
+    cv.Optional(CONF_POOL_SIZE, default=2): cv.int_range(min=1, max=8),
+    cv.Optional(CONF_IDLE_TIMEOUT, default='60s'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_KEEPALIVE_INTERVAL, default='20s'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_CONNECT_TIMEOUT, default='5s'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_DNS_TTL, default='5min'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_CHUNK_SIZE, default=4096): cv.int_range(min=512, max=65536),
+    cv.Optional(CONF_BUFFER_COUNT, default=4): cv.int_range(min=1, max=16),
+    cv.Optional(CONF_MAX_CONCURRENT, default=2): cv.int_range(min=1, max=8),
+    cv.Optional(CONF_QUEUE_SIZE, default=4): cv.int_range(min=1, max=32),
+    cv.Optional(CONF_CLIENT_RATE_LIMIT, default=0): cv.int_range(min=0),
+    cv.Optional(CONF_GLOBAL_RATE_LIMIT, default=0): cv.int_range(min=0),
+    cv.Optional(CONF_PRIORITIES, default=[]): cv.ensure_list(PRIORITY_SCHEMA),
+    cv.Optional(CONF_QUEUE_TIMEOUT, default='5s'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_COALESCE_BUFFER, default=65536): cv.int_range(min=0, max=4194304),
+    cv.Optional(CONF_METADATA_TTL, default='10s'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_DIRECTORIES, default=[]): cv.ensure_list(validate_directory),
+    cv.Optional(CONF_LISTING_TTL, default='30s'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_MODE_Z, default=False): cv.boolean,
+    cv.Optional(CONF_MAX_RETRIES, default=3): cv.int_range(min=0, max=10),
+    cv.Optional(CONF_RETRY_BACKOFF, default='500ms'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_ALLOW_UPLOAD, default=False): cv.boolean,
+    cv.Optional(CONF_UPLOAD_CHUNK_SIZE, default=4096): cv.int_range(min=512, max=65536),
+    cv.Optional(CONF_PREFETCH, default=False): cv.boolean,
+    cv.Optional(CONF_REFRESH_INTERVAL, default='10min'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_PREFETCH_RAM_LIMIT, default=32768): cv.int_range(min=0, max=4194304),
+    cv.Optional(CONF_PREFETCH_RAM_BUDGET, default=131072): cv.int_range(min=0, max=16777216),
+    cv.Optional(CONF_STORAGE_COMPONENT): cv.use_id(StorageComponent),
+    cv.Optional(CONF_CACHE_DIR, default='/ftp_cache'): cv.string,
+    cv.Optional(CONF_CACHE_TTL, default='5min'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_SEGMENTS, default=1): cv.int_range(min=1, max=8),
+    cv.Optional(CONF_SEGMENT_MIN_SIZE, default=1048576): cv.int_range(min=65536),
+    cv.Optional(CONF_MIRROR): MIRROR_SCHEMA,
+    cv.Optional(CONF_METRICS, default=False): cv.boolean,
+    cv.Optional(CONF_TRACE_SIZE, default=0): cv.int_range(min=0, max=4096),
+    cv.Optional(CONF_THROUGHPUT): sensor.sensor_schema(
+        unit_of_measurement='B/s', accuracy_decimals=0, state_class=STATE_CLASS_MEASUREMENT),
+    cv.Optional(CONF_FIRST_BYTE_TIME): sensor.sensor_schema(
+        unit_of_measurement=UNIT_MILLISECOND, accuracy_decimals=0, state_class=STATE_CLASS_MEASUREMENT),
+}), validate_upstreams, validate_mirror, validate_sockets)
 
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
     
     # Configuration des paramètres
-    cg.add(var.set_ftp_server(config[CONF_SERVER]))
-    cg.add(var.set_username(config[CONF_USERNAME]))
-    cg.add(var.set_password(config[CONF_PASSWORD]))
+    for upstream in config[CONF_UPSTREAMS]:
+        cg.add(var.add_upstream(upstream[CONF_SERVER], upstream[CONF_PORT], upstream[CONF_USERNAME],
+                                upstream[CONF_PASSWORD], upstream[CONF_WEIGHT]))
+    cg.add(var.set_health_check_interval(config[CONF_HEALTH_CHECK_INTERVAL]))
+
+    # FTPS explicite sur tous les amonts : AUTH TLS, puis PROT P pour les
+    # données. tls_verify: false accepte un certificat auto-signé (tests)
+    if config[CONF_TLS]:
+        cg.add_define('USE_FTP_HTTP_PROXY_TLS')
+        cg.add(var.set_tls_verify(config[CONF_TLS_VERIFY]))
     
-    # Ajout des chemins distants
-    for remote_path in config[CONF_REMOTE_PATHS]:
+    # Chemins exacts triés pour une recherche dichotomique, règles génériques
+    # (firmware/*.bin) compilées en trie de préfixes
+    paths = config[CONF_REMOTE_PATHS]
+    for remote_path in sorted(set(p for p in paths if not is_route_pattern(p))):
         cg.add(var.add_remote_path(remote_path))
+    patterns = [p for p in paths if is_route_pattern(p)]
+    if patterns:
+        emit_route_table(var, str(config[CONF_ID].id), patterns)
     
     cg.add(var.set_local_port(config[CONF_LOCAL_PORT]))
+
+    # Pool de connexions FTP
+    cg.add(var.set_pool_size(config[CONF_POOL_SIZE]))
+    cg.add(var.set_idle_timeout(config[CONF_IDLE_TIMEOUT]))
+    cg.add(var.set_keepalive_interval(config[CONF_KEEPALIVE_INTERVAL]))
+    cg.add(var.set_connect_timeout(config[CONF_CONNECT_TIMEOUT]))
+    cg.add(var.set_dns_ttl(config[CONF_DNS_TTL]))
+
+    # Tampon de relais FTP -> HTTP (buffer_count = 1 : transfert séquentiel)
+    cg.add(var.set_chunk_size(config[CONF_CHUNK_SIZE]))
+    cg.add(var.set_buffer_count(config[CONF_BUFFER_COUNT]))
+    cg.add(var.set_max_concurrent(config[CONF_MAX_CONCURRENT]))
+    # Au-delà de queue_size requêtes en attente, ou après queue_timeout : 503
+    cg.add(var.set_queue_size(config[CONF_QUEUE_SIZE]))
+    cg.add(var.set_queue_timeout(config[CONF_QUEUE_TIMEOUT]))
+    if CORE.using_esp_idf:
+        # La valeur par défaut (10) ne couvre pas le serveur HTTP et le pool FTP
+        add_idf_sdkconfig_option('CONFIG_LWIP_MAX_SOCKETS', lwip_sockets(config))
+    # Limites de débit en octets/s (0 : aucune) et classes de priorité par
+    # chemin (motifs glob comme remote_paths, première règle qui correspond)
+    cg.add(var.set_client_rate_limit(config[CONF_CLIENT_RATE_LIMIT]))
+    cg.add(var.set_global_rate_limit(config[CONF_GLOBAL_RATE_LIMIT]))
+    for rule in config[CONF_PRIORITIES]:
+        cg.add(var.add_priority_rule(rule[CONF_PATH], rule[CONF_PRIORITY]))
+    # Regroupement des téléchargements simultanés (0 : désactivé)
+    cg.add(var.set_coalesce_buffer(config[CONF_COALESCE_BUFFER]))
+    # Durée de validité des métadonnées SIZE/MDTM pour les réponses 304
+    cg.add(var.set_metadata_ttl(config[CONF_METADATA_TTL]))
+    # Listings JSON (MLSD, LIST à défaut) sur "<répertoire>/" ; leurs fichiers
+    # sont servis en lecture et leurs SIZE/MDTM répondent aux HEAD
+    for directory in config[CONF_DIRECTORIES]:
+        cg.add(var.add_listing_dir(directory))
+    cg.add(var.set_listing_ttl(config[CONF_LISTING_TTL]))
+    # Canal de données compressé, ignoré par les serveurs sans MODE Z
+    cg.add(var.set_mode_z(config[CONF_MODE_Z]))
+    # Reprise REST d'un transfert interrompu (0 : désactivée)
+    cg.add(var.set_max_retries(config[CONF_MAX_RETRIES]))
+    cg.add(var.set_retry_backoff(config[CONF_RETRY_BACKOFF]))
+    # Envoi PUT/POST vers STOR, limité aux mêmes chemins que les téléchargements
+    cg.add(var.set_allow_upload(config[CONF_ALLOW_UPLOAD]))
+    cg.add(var.set_upload_chunk_size(config[CONF_UPLOAD_CHUNK_SIZE]))
+    # Préchargement des chemins exacts : RAM jusqu'à prefetch_ram_limit par
+    # fichier, carte SD au-delà (si storage_component est configuré)
+    cg.add(var.set_prefetch(config[CONF_PREFETCH]))
+    cg.add(var.set_refresh_interval(config[CONF_REFRESH_INTERVAL]))
+    cg.add(var.set_prefetch_ram_limit(config[CONF_PREFETCH_RAM_LIMIT]))
+    cg.add(var.set_prefetch_ram_budget(config[CONF_PREFETCH_RAM_BUDGET]))
+
+    # Histogrammes par phase sur /metrics (format Prometheus) ; les capteurs
+    # publient toutes les 10 s les moyennes des transferts terminés
+    cg.add(var.set_metrics_endpoint(config[CONF_METRICS]))
+    if CONF_THROUGHPUT in config:
+        sens = await sensor.new_sensor(config[CONF_THROUGHPUT])
+        cg.add(var.set_throughput_sensor(sens))
+    if CONF_FIRST_BYTE_TIME in config:
+        sens = await sensor.new_sensor(config[CONF_FIRST_BYTE_TIME])
+        cg.add(var.set_first_byte_sensor(sens))
+    # Dernières requêtes détaillées sur /trace (JSON lines), environ 200 octets
+    # par trace pris au démarrage (PSRAM si présente) ; 0, par défaut, désactive
+    cg.add(var.set_trace_size(config[CONF_TRACE_SIZE]))
+
+    # Cache SD optionnel
+    if CONF_STORAGE_COMPONENT in config:
+        cg.add_define('USE_FTP_HTTP_PROXY_CACHE')
+        storage = await cg.get_variable(config[CONF_STORAGE_COMPONENT])
+        cg.add(var.set_storage_component(storage))
+        cg.add(var.set_cache_dir(config[CONF_CACHE_DIR]))
+        cg.add(var.set_cache_ttl(config[CONF_CACHE_TTL]))
+        # Téléchargement segmenté des gros fichiers (limité par pool_size)
+        cg.add(var.set_segments(config[CONF_SEGMENTS]))
+        cg.add(var.set_segment_min_size(config[CONF_SEGMENT_MIN_SIZE]))
+        # Miroir incrémental de répertoires distants sous mirror.path : seuls
+        # les fichiers nouveaux ou modifiés (taille, date, CRC XCRC) sont copiés
+        if CONF_MIRROR in config:
+            mirror = config[CONF_MIRROR]
+            for directory in mirror[CONF_DIRECTORIES]:
+                cg.add(var.add_mirror_dir(directory))
+            cg.add(var.set_mirror_path(mirror[CONF_PATH]))
+            cg.add(var.set_mirror_interval(mirror[CONF_INTERVAL]))
+            cg.add(var.set_mirror_rate_limit(mirror[CONF_RATE_LIMIT]))
+            cg.add(var.set_mirror_checksum(mirror[CONF_CHECKSUM]))
@@ -3,207 +3,3981 @@
 #include <lwip/sockets.h>
 #include <netdb.h>
 #include <cstring>
+#include <cctype>
+#include <cmath>
+#include <algorithm>
 #include <arpa/inet.h>
+#include <esp_heap_caps.h>
+#include <freertos/task.h>
+#include <rom/miniz.h>
+#ifdef USE_FTP_HTTP_PROXY_TLS
+#include <esp_crt_bundle.h>
+#include <esp_random.h>
+#endif
 
 static const char *TAG = "ftp_proxy";
 
 namespace esphome {
 namespace ftp_http_proxy {
 
+// Date UTC -> time_t sans passer par le fuseau local (timegm n'existe pas sur newlib)
+static time_t utc_to_time(int y, int mo, int d, int hh, int mi, int ss) {
+  y -= mo <= 2;
+  int era = (y >= 0 ? y : y - 399) / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  int64_t days = (int64_t) era * 146097 + doe - 719468;
+  return (time_t) (days * 86400 + hh * 3600 + mi * 60 + ss);
+}
+
+// Le flux deflate transmis tel quel (MODE Z) est une autre représentation : ETag distinct
+static void format_etag(const RemoteFileInfo &info, char *buffer, size_t len, bool compressed = false) {
+  snprintf(buffer, len, "\"%x-%llx%s\"", (unsigned) info.size, (unsigned long long) info.mtime,
+           compressed ? "-z" : "");
+}
+
+// Toute tâche qui ouvre une connexion de contrôle peut faire une poignée de
+// main TLS complète (vérification du certificat comprise) dans sa propre pile
+#ifdef USE_FTP_HTTP_PROXY_TLS
+static const uint32_t TLS_STACK_EXTRA = 4096;
+#else
+static const uint32_t TLS_STACK_EXTRA = 0;
+#endif
+
+#ifdef USE_FTP_HTTP_PROXY_TLS
+// Canaux TLS par descripteur : contrôle et données restent des int partout,
+// seules les lectures et écritures passent par le canal quand il existe
+static Mutex tls_channels_mutex;
+static std::map<int, TlsChannel *> tls_channels;
+
+static TlsChannel *tls_channel(int sock) {
+  LockGuard lock(tls_channels_mutex);
+  auto it = tls_channels.find(sock);
+  return it != tls_channels.end() ? it->second : nullptr;
+}
+
+static int tls_random(void *, unsigned char *output, size_t len) {
+  esp_fill_random(output, len);
+  return 0;
+}
+
+TlsChannel::TlsChannel() {
+  mbedtls_ssl_init(&ssl_);
+  mbedtls_net_init(&net_);
+}
+
+TlsChannel::~TlsChannel() {
+  if (established_) {
+    mbedtls_ssl_close_notify(&ssl_);
+  }
+  // net_ n'est pas libéré : le socket est fermé par sock_close()
+  mbedtls_ssl_free(&ssl_);
+}
+
+bool TlsChannel::handshake(int sock, const mbedtls_ssl_config *conf, const char *host, const TlsSession *resume) {
+  net_.fd = sock;
+  if (mbedtls_ssl_setup(&ssl_, conf) != 0 || mbedtls_ssl_set_hostname(&ssl_, host) != 0) {
+    return false;
+  }
+  // Session refusée ou expirée côté serveur : poignée de main complète
+  if (resume != nullptr) {
+    mbedtls_ssl_set_session(&ssl_, &resume->session);
+  }
+  mbedtls_ssl_set_bio(&ssl_, &net_, mbedtls_net_send, mbedtls_net_recv, nullptr);
+
+  int ret;
+  while ((ret = mbedtls_ssl_handshake(&ssl_)) != 0) {
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      ESP_LOGW(TAG, "Échec de la négociation TLS : -0x%04x", -ret);
+      return false;
+    }
+  }
+  established_ = true;
+  return true;
+}
+
+int TlsChannel::read(char *data, size_t len) {
+  int ret;
+  do {
+    ret = mbedtls_ssl_read(&ssl_, (unsigned char *) data, len);
+  } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+  if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+    return 0;
+  }
+  return ret < 0 ? -1 : ret;
+}
+
+int TlsChannel::write(const char *data, size_t len) {
+  int ret;
+  do {
+    ret = mbedtls_ssl_write(&ssl_, (const unsigned char *) data, len);
+  } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+  return ret < 0 ? -1 : ret;
+}
+#endif
+
+// E/S des sockets FTP, en clair ou à travers TLS
+static int sock_send(int sock, const char *data, size_t len) {
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  TlsChannel *tls = tls_channel(sock);
+  if (tls != nullptr) {
+    return tls->write(data, len);
+  }
+#endif
+  return ::send(sock, data, len, 0);
+}
+
+static int sock_recv(int sock, char *data, size_t len) {
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  TlsChannel *tls = tls_channel(sock);
+  if (tls != nullptr) {
+    return tls->read(data, len);
+  }
+#endif
+  return ::recv(sock, data, len, 0);
+}
+
+static void sock_close(int sock) {
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  TlsChannel *tls = nullptr;
+  {
+    LockGuard lock(tls_channels_mutex);
+    auto it = tls_channels.find(sock);
+    if (it != tls_channels.end()) {
+      tls = it->second;
+      tls_channels.erase(it);
+    }
+  }
+  delete tls;
+#endif
+  ::close(sock);
+}
+
+// Fermeture par RST : le serveur voit un transfert interrompu, pas une fin de fichier
+static void sock_abort(int sock) {
+  struct linger reset = {1, 0};
+  setsockopt(sock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  TlsChannel *tls = tls_channel(sock);
+  if (tls != nullptr) {
+    tls->abandon();
+  }
+#endif
+  sock_close(sock);
+}
+
+// QUIT puis fermeture (close_notify en TLS) d'une connexion de contrôle détachée
+static void quit_control(int sock) {
+  if (sock >= 0) {
+    sock_send(sock, "QUIT\r\n", 6);
+    sock_close(sock);
+  }
+}
+
+// Au-delà d'un seau, les écritures sont découpées pour que l'attente reste courte
+static const size_t SHAPING_CHUNK = 4096;
+
+TokenBucket::TokenBucket(uint32_t rate, uint32_t burst)
+    : rate_(rate), burst_((int64_t) burst * 1000000), tokens_(burst_), last_(micros()) {}
+
+void TokenBucket::consume(size_t len) {
+  int64_t wait_us;
+  {
+    LockGuard lock(mutex_);
+    uint32_t now = micros();
+    tokens_ = std::min(burst_, tokens_ + (int64_t) (now - last_) * rate_);
+    last_ = now;
+    tokens_ -= (int64_t) len * 1000000;
+    wait_us = tokens_ < 0 ? -tokens_ / rate_ : 0;
+  }
+  if (wait_us >= 1000) {
+    vTaskDelay(pdMS_TO_TICKS(wait_us / 1000));
+  }
+}
+
+void ResponseStream::add_header(const char *name, const std::string &value) {
+  headers_ += name;
+  headers_ += ": ";
+  headers_ += value;
+  headers_ += "\r\n";
+}
+
+void ResponseStream::remove_header(const char *name) {
+  size_t name_len = strlen(name);
+  size_t pos = 0;
+  while (pos < headers_.size()) {
+    size_t end = headers_.find("\r\n", pos);
+    end = end == std::string::npos ? headers_.size() : end + 2;
+    if (headers_.compare(pos, name_len, name) == 0 && headers_.compare(pos + name_len, 1, ":") == 0) {
+      headers_.erase(pos, end - pos);
+    } else {
+      pos = end;
+    }
+  }
+}
+
+bool ResponseStream::send_all(const char *data, size_t len, bool more) {
+  // Envoi direct sur le socket du client : MSG_MORE laisse l'en-tête et le
+  // cadrage chunked partir dans le même segment que les données qui suivent
+  while (len > 0) {
+    int sent = ::send(sock_, data, len, more ? MSG_MORE : 0);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      failed_ = true;
+      return false;
+    }
+    data += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+bool ResponseStream::begin() {
+  std::string head = "HTTP/1.1 ";
+  head += status_;
+  head += "\r\nContent-Type: ";
+  head += content_type_;
+  head += "\r\n";
+  if (no_body_) {
+    // 304 : ni longueur ni corps
+  } else if (chunked_) {
+    head += "Transfer-Encoding: chunked\r\n";
+  } else {
+    head += "Content-Length: " + std::to_string(content_length_) + "\r\n";
+  }
+  head += headers_;
+  head += "\r\n";
+
+  started_ = true;
+  return send_all(head.c_str(), head.size(), !no_body_ && (chunked_ || content_length_ > 0));
+}
+
+bool ResponseStream::write(const char *data, size_t len) {
+  if (!started_ && !begin()) {
+    return false;
+  }
+  if (client_bucket_ == nullptr && global_bucket_ == nullptr) {
+    return write_chunk(data, len);
+  }
+
+  // Débit limité : chaque morceau est décompté avant de partir
+  while (len > 0) {
+    size_t n = std::min(len, SHAPING_CHUNK);
+    if (client_bucket_ != nullptr) {
+      client_bucket_->consume(n);
+    }
+    if (global_bucket_ != nullptr) {
+      global_bucket_->consume(n);
+    }
+    if (!write_chunk(data, n)) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool ResponseStream::write_chunk(const char *data, size_t len) {
+  if (len == 0) {
+    return true;
+  }
+  body_bytes_ += len;
+  if (!chunked_) {
+    return send_all(data, len);
+  }
+
+  char prefix[12];
+  int n = snprintf(prefix, sizeof(prefix), "%x\r\n", (unsigned) len);
+  return send_all(prefix, n, true) && send_all(data, len, true) && send_all("\r\n", 2);
+}
+
+bool ResponseStream::finish() {
+  if (!started_ && !begin()) {
+    return false;
+  }
+  return no_body_ || !chunked_ || send_all("0\r\n\r\n", 5);
+}
+
+// Bornes des histogrammes : durées en ms, débits en octets/s
+static const uint32_t DURATION_BOUNDS[Histogram::BOUNDS] = {1,   5,    10,   25,   50,    100,  250,
+                                                            500, 1000, 2500, 5000, 10000, 30000};
+static const uint32_t THROUGHPUT_BOUNDS[Histogram::BOUNDS] = {1024,   4096,    16384,   32768,   65536,
+                                                              131072, 262144,  524288,  1048576, 2097152,
+                                                              4194304, 8388608, 16777216};
+static const char *const PHASE_NAMES[PHASE_COUNT] = {"queue", "dns",      "connect",  "login",
+                                                     "control", "first_byte", "transfer", "client"};
+
+void Histogram::observe(uint32_t value, const uint32_t *bounds) {
+  uint8_t i = 0;
+  while (i < BOUNDS && value > bounds[i]) {
+    i++;
+  }
+  counts[i]++;
+  count++;
+  sum += value;
+}
+
+void ProxyMetrics::observe(MetricPhase phase, uint32_t ms) {
+  LockGuard lock(mutex_);
+  phases_[phase].observe(ms, DURATION_BOUNDS);
+  if (phase == PHASE_FIRST_BYTE) {
+    window_first_byte_ += ms;
+    window_first_bytes_++;
+  }
+}
+
+void ProxyMetrics::record_transfer(uint64_t bytes, uint32_t transfer_ms, bool ok) {
+  LockGuard lock(mutex_);
+  bytes_ += bytes;
+  if (!ok) {
+    failed_++;
+    return;
+  }
+  completed_++;
+  throughput_.observe(bytes * 1000 / std::max<uint32_t>(transfer_ms, 1), THROUGHPUT_BOUNDS);
+  window_bytes_ += bytes;
+  window_ms_ += transfer_ms;
+}
+
+bool ProxyMetrics::take_window(float &throughput, float &first_byte_ms) {
+  LockGuard lock(mutex_);
+  if (window_first_bytes_ == 0 && window_ms_ == 0) {
+    return false;
+  }
+  throughput = window_ms_ > 0 ? window_bytes_ * 1000.0f / window_ms_ : NAN;
+  first_byte_ms = window_first_bytes_ > 0 ? (float) window_first_byte_ / window_first_bytes_ : NAN;
+  window_bytes_ = window_ms_ = window_first_byte_ = 0;
+  window_first_bytes_ = 0;
+  return true;
+}
+
+static void render_histogram(std::string &out, const char *name, const char *labels, const Histogram &histogram,
+                             const uint32_t *bounds, float scale) {
+  char line[160];
+  uint32_t cumulative = 0;
+  for (uint8_t i = 0; i <= Histogram::BOUNDS; i++) {
+    cumulative += histogram.counts[i];
+    char le[16] = "+Inf";
+    if (i < Histogram::BOUNDS) {
+      snprintf(le, sizeof(le), "%g", bounds[i] * scale);
+    }
+    snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%s\"} %u\n", name, labels, *labels ? "," : "", le,
+             (unsigned) cumulative);
+    out += line;
+  }
+  const char *braces_open = *labels ? "{" : "";
+  const char *braces_close = *labels ? "}" : "";
+  snprintf(line, sizeof(line), "%s_sum%s%s%s %g\n%s_count%s%s%s %u\n", name, braces_open, labels, braces_close,
+           histogram.sum * scale, name, braces_open, labels, braces_close, (unsigned) histogram.count);
+  out += line;
+}
+
+void ProxyMetrics::render(std::string &out) const {
+  // Copie sous verrou, mise en forme sans le tenir
+  Histogram phases[PHASE_COUNT];
+  Histogram throughput;
+  uint64_t bytes;
+  uint32_t completed, failed;
+  {
+    LockGuard lock(mutex_);
+    std::copy(phases_, phases_ + PHASE_COUNT, phases);
+    throughput = throughput_;
+    bytes = bytes_;
+    completed = completed_;
+    failed = failed_;
+  }
+
+  out += "# HELP ftp_proxy_phase_seconds Durée de chaque phase des transferts FTP\n"
+         "# TYPE ftp_proxy_phase_seconds histogram\n";
+  for (uint8_t phase = 0; phase < PHASE_COUNT; phase++) {
+    char labels[32];
+    snprintf(labels, sizeof(labels), "phase=\"%s\"", PHASE_NAMES[phase]);
+    render_histogram(out, "ftp_proxy_phase_seconds", labels, phases[phase], DURATION_BOUNDS, 0.001f);
+  }
+  out += "# HELP ftp_proxy_transfer_throughput_bytes_per_second Débit de chaque transfert FTP réussi\n"
+         "# TYPE ftp_proxy_transfer_throughput_bytes_per_second histogram\n";
+  render_histogram(out, "ftp_proxy_transfer_throughput_bytes_per_second", "", throughput, THROUGHPUT_BOUNDS, 1.0f);
+
+  char line[128];
+  snprintf(line, sizeof(line),
+           "# TYPE ftp_proxy_transfer_bytes_total counter\nftp_proxy_transfer_bytes_total %llu\n",
+           (unsigned long long) bytes);
+  out += line;
+  snprintf(line, sizeof(line),
+           "# TYPE ftp_proxy_transfers_total counter\nftp_proxy_transfers_total{result=\"ok\"} %u\n"
+           "ftp_proxy_transfers_total{result=\"error\"} %u\n",
+           (unsigned) completed, (unsigned) failed);
+  out += line;
+}
+
+bool TraceRing::init(size_t capacity) {
+  // En PSRAM quand elle est présente : quelques centaines d'entrées y tiennent
+  records_ = (TraceRecord *) heap_caps_malloc(capacity * sizeof(TraceRecord), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (records_ == nullptr) {
+    records_ = (TraceRecord *) heap_caps_malloc(capacity * sizeof(TraceRecord), MALLOC_CAP_8BIT);
+  }
+  capacity_ = records_ != nullptr ? capacity : 0;
+  return records_ != nullptr;
+}
+
+void TraceRing::push(const TraceRecord &record) {
+  LockGuard lock(mutex_);
+  records_[next_ % capacity_] = record;
+  next_++;
+}
+
+void TraceRing::bounds(uint32_t &first, uint32_t &next) const {
+  LockGuard lock(mutex_);
+  next = next_;
+  first = next_ > capacity_ ? next_ - capacity_ : 0;
+}
+
+bool TraceRing::read(uint32_t seq, TraceRecord &record) const {
+  LockGuard lock(mutex_);
+  if (seq >= next_ || next_ - seq > capacity_) {
+    return false;
+  }
+  record = records_[seq % capacity_];
+  return true;
+}
+
+RelayPipe::~RelayPipe() {
+  if (free_q_ != nullptr) vQueueDelete(free_q_);
+  if (full_q_ != nullptr) vQueueDelete(full_q_);
+  if (done_ != nullptr) vSemaphoreDelete(done_);
+  heap_caps_free(storage_);
+}
+
+bool RelayPipe::init(size_t block_size, size_t depth) {
+  block_size_ = block_size;
+
+  // Les blocs vont en PSRAM quand elle est présente, en RAM interne sinon
+  storage_ = (char *) heap_caps_malloc(block_size * depth, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (storage_ == nullptr) {
+    storage_ = (char *) heap_caps_malloc(block_size * depth, MALLOC_CAP_8BIT);
+  }
+  lengths_.resize(depth);
+  free_q_ = xQueueCreate(depth, sizeof(uint8_t));
+  full_q_ = xQueueCreate(depth, sizeof(uint8_t));
+  done_ = xSemaphoreCreateBinary();
+  if (storage_ == nullptr || free_q_ == nullptr || full_q_ == nullptr || done_ == nullptr) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < depth; i++) {
+    xQueueSend(free_q_, &i, 0);
+  }
+  return true;
+}
+
+bool RelayPipe::start(int data_sock, size_t remaining) {
+  data_sock_ = data_sock;
+  remaining_ = remaining;
+  abort_ = false;
+  // Le déchiffrement TLS se fait dans cette tâche : pile plus grande
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  const uint32_t stack = 5120;
+#else
+  const uint32_t stack = 3072;
+#endif
+  return xTaskCreate(producer_task, "ftp_relay", stack, this, uxTaskPriorityGet(nullptr), nullptr) == pdPASS;
+}
+
+void RelayPipe::producer_task(void *arg) {
+  auto *pipe = static_cast<RelayPipe *>(arg);
+  uint8_t index;
+
+  // Un bloc de longueur <= 0 marque la fin du flux (EOF, erreur ou abandon)
+  while (xQueueReceive(pipe->free_q_, &index, portMAX_DELAY) == pdTRUE) {
+    int len = 0;
+    if (!pipe->abort_ && pipe->remaining_ > 0) {
+      len = sock_recv(pipe->data_sock_, pipe->block(index), std::min(pipe->block_size_, pipe->remaining_));
+    }
+    if (len > 0 && pipe->remaining_ != SIZE_MAX) {
+      pipe->remaining_ -= len;
+    }
+    pipe->lengths_[index] = len;
+    xQueueSend(pipe->full_q_, &index, portMAX_DELAY);
+    if (len <= 0) {
+      break;
+    }
+  }
+
+  xSemaphoreGive(pipe->done_);
+  vTaskDelete(nullptr);
+}
+
+bool RelayPipe::drain(const RelaySink &sink, size_t &remaining) {
+  bool sink_ok = true;
+  uint8_t index;
+
+  while (xQueueReceive(full_q_, &index, portMAX_DELAY) == pdTRUE) {
+    int len = lengths_[index];
+    if (len <= 0) {
+      break;
+    }
+    sink_ok = sink(block(index), len);
+    xQueueSend(free_q_, &index, 0);
+    if (!sink_ok) {
+      // Débloque un recv() en cours dans la tâche de lecture
+      abort_ = true;
+      shutdown(data_sock_, SHUT_RDWR);
+      break;
+    }
+  }
+
+  // Attente de la fin de la tâche ; les blocs encore pleins sont recyclés
+  // pour qu'elle ne reste pas bloquée sur la file des blocs libres
+  while (xSemaphoreTake(done_, pdMS_TO_TICKS(10)) != pdTRUE) {
+    while (xQueueReceive(full_q_, &index, 0) == pdTRUE) {
+      xQueueSend(free_q_, &index, 0);
+    }
+  }
+  remaining = remaining_;
+  return sink_ok;
+}
+
+Inflater::~Inflater() {
+  heap_caps_free(decomp_);
+  heap_caps_free(dict_);
+}
+
+bool Inflater::init() {
+  // Fenêtre de 32 Kio : en PSRAM quand elle est présente
+  decomp_ = (tinfl_decompressor *) heap_caps_malloc(sizeof(tinfl_decompressor), MALLOC_CAP_8BIT);
+  dict_ = (uint8_t *) heap_caps_malloc(TINFL_LZ_DICT_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (dict_ == nullptr) {
+    dict_ = (uint8_t *) heap_caps_malloc(TINFL_LZ_DICT_SIZE, MALLOC_CAP_8BIT);
+  }
+  if (decomp_ == nullptr || dict_ == nullptr) {
+    return false;
+  }
+  tinfl_init(decomp_);
+  return true;
+}
+
+bool Inflater::feed(const char *data, size_t len, const RelaySink &sink) {
+  const mz_uint8 *in = (const mz_uint8 *) data;
+  while (!done_) {
+    size_t in_bytes = len;
+    size_t out_bytes = TINFL_LZ_DICT_SIZE - dict_pos_;
+    tinfl_status status = tinfl_decompress(decomp_, in, &in_bytes, dict_, dict_ + dict_pos_, &out_bytes,
+                                           TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+    in += in_bytes;
+    len -= in_bytes;
+    if (out_bytes > 0 && !sink((const char *) dict_ + dict_pos_, out_bytes)) {
+      return false;
+    }
+    dict_pos_ = (dict_pos_ + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+
+    if (status < TINFL_STATUS_DONE) {
+      ESP_LOGW(TAG, "Flux MODE Z invalide (%d)", (int) status);
+      return false;
+    }
+    done_ = status == TINFL_STATUS_DONE;
+    if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+      return true;
+    }
+  }
+  // Octets après la fin du flux zlib : réponse incohérente
+  return len == 0;
+}
+
 void FTPHTTPProxy::setup() {
   ESP_LOGI(TAG, "Initialisation du proxy FTP/HTTP");
+  pool_.resize(pool_size_);
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  // Pas de repli en clair : sans configuration TLS, le proxy ne démarre pas
+  if (!setup_tls()) {
+    ESP_LOGE(TAG, "Configuration TLS impossible");
+    this->mark_failed();
+    return;
+  }
+#endif
+  if (trace_size_ > 0 && !trace_.init(trace_size_)) {
+    ESP_LOGW(TAG, "Mémoire insuffisante pour %u traces, traçage désactivé", trace_size_);
+  }
+  if (global_rate_limit_ > 0) {
+    global_bucket_.reset(
+        new TokenBucket(global_rate_limit_, std::max<uint32_t>(global_rate_limit_ / 4, SHAPING_CHUNK)));
+  }
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  if (storage_ != nullptr && !storage_->create_directory_direct(cache_dir_)) {
+    ESP_LOGW(TAG, "Répertoire de cache %s indisponible, cache désactivé", cache_dir_.c_str());
+    storage_ = nullptr;
+  }
+  if (storage_ != nullptr && !mirror_dirs_.empty() && !storage_->create_directory_direct(mirror_path_)) {
+    ESP_LOGW(TAG, "Répertoire du miroir %s indisponible, miroir désactivé", mirror_path_.c_str());
+    mirror_dirs_.clear();
+  }
+#endif
   this->setup_http_server();
 }
 
-void FTPHTTPProxy::loop() {}
+void FTPHTTPProxy::loop() {
+  uint32_t now = millis();
+  if (now - last_pool_check_ < 1000) {
+    return;
+  }
+  last_pool_check_ = now;
+
+  // Résolution DNS rafraîchie en tâche de fond avant expiration
+  // (au plus une tentative toutes les 10 s si le DNS ne répond pas)
+  if (!dns_refreshing_ && now - dns_last_attempt_ >= 10000) {
+    bool due = false;
+    {
+      LockGuard lock(dns_mutex_);
+      for (const auto &upstream : upstreams_) {
+        due |= upstream.dns.count == 0 || now - upstream.dns.resolved_at >= dns_ttl_ / 4 * 3;
+      }
+    }
+    if (due) {
+      dns_last_attempt_ = now;
+      dns_refreshing_ = true;
+      if (xTaskCreate(dns_refresh_task, "ftp_dns", 3072, this, tskIDLE_PRIORITY + 1, nullptr) != pdPASS) {
+        dns_refreshing_ = false;
+      }
+    }
+  }
+
+  // Préchargement au premier passage (réseau prêt), puis revalidation périodique
+  if (prefetch_ && !prefetch_running_ && (int32_t) (now - prefetch_next_) >= 0) {
+    prefetch_running_ = true;
+    if (xTaskCreate(prefetch_task, "ftp_prefetch", 6144 + TLS_STACK_EXTRA, this, tskIDLE_PRIORITY + 1, nullptr) !=
+        pdPASS) {
+      prefetch_running_ = false;
+    }
+  }
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  // Synchronisation du miroir au premier passage, puis à intervalle fixe
+  if (storage_ != nullptr && !mirror_dirs_.empty() && !mirror_running_ && (int32_t) (now - mirror_next_) >= 0) {
+    mirror_running_ = true;
+    if (xTaskCreate(mirror_task, "ftp_mirror", 6144 + TLS_STACK_EXTRA, this, tskIDLE_PRIORITY + 1, nullptr) != pdPASS) {
+      mirror_running_ = false;
+    }
+  }
+#endif
+
+  // Contrôle de santé des amonts, inutile avec un seul serveur
+  if (upstreams_.size() > 1 && !health_checking_ && now - last_health_check_ >= health_check_interval_) {
+    last_health_check_ = now;
+    health_checking_ = true;
+    if (xTaskCreate(health_check_task, "ftp_health", 4096 + TLS_STACK_EXTRA, this, tskIDLE_PRIORITY + 1, nullptr) !=
+        pdPASS) {
+      health_checking_ = false;
+    }
+  }
+
+  // Bilan de l'admission quand des requêtes ont été refusées depuis le dernier
+  uint32_t rejected = rejected_ + expired_;
+  if (rejected != last_rejected_report_ && now - last_admission_report_ >= 60000) {
+    last_admission_report_ = now;
+    last_rejected_report_ = rejected;
+    ESP_LOGW(TAG, "Surcharge : %u actifs, %u en attente, %u refusés (file pleine), %u expirés", (unsigned) active_,
+             (unsigned) get_queue_depth(), (unsigned) rejected_, (unsigned) expired_);
+  }
+
+#ifdef USE_SENSOR
+  // Moyennes des transferts terminés depuis la dernière publication
+  float throughput, first_byte;
+  if ((throughput_sensor_ != nullptr || first_byte_sensor_ != nullptr) && now - last_sensor_publish_ >= 10000 &&
+      metrics_.take_window(throughput, first_byte)) {
+    last_sensor_publish_ = now;
+    if (throughput_sensor_ != nullptr && !std::isnan(throughput)) {
+      throughput_sensor_->publish_state(throughput);
+    }
+    if (first_byte_sensor_ != nullptr && !std::isnan(first_byte)) {
+      first_byte_sensor_->publish_state(first_byte);
+    }
+  }
+#endif
+
+  // Fermeture des connexions inactives et NOOP sur les autres, en tâche de
+  // fond : un serveur muet bloquerait la boucle principale jusqu'au délai
+  // de réception
+  if (!pool_maintaining_ && pool_maintenance_due(now)) {
+    pool_maintaining_ = true;
+    if (xTaskCreate(keepalive_task, "ftp_keepalive", 3072 + TLS_STACK_EXTRA, this, tskIDLE_PRIORITY + 1, nullptr) !=
+        pdPASS) {
+      pool_maintaining_ = false;
+    }
+  }
+}
+
+bool FTPHTTPProxy::pool_maintenance_due(uint32_t now) {
+  LockGuard lock(pool_mutex_);
+  return std::any_of(pool_.begin(), pool_.end(), [this, now](const FTPSession &session) {
+    return !session.in_use && session.sock >= 0 &&
+           (now - session.last_used >= idle_timeout_ || now - session.last_check >= keepalive_interval_);
+  });
+}
+
+void FTPHTTPProxy::keepalive_task(void *arg) {
+  auto *proxy = static_cast<FTPHTTPProxy *>(arg);
+  for (auto &session : proxy->pool_) {
+    // QUIT et fermeture TLS se font hors du verrou du pool
+    int stale = -1;
+    {
+      LockGuard lock(proxy->pool_mutex_);
+      uint32_t now = millis();
+      if (session.in_use || session.sock < 0) {
+        continue;
+      }
+      if (now - session.last_used >= proxy->idle_timeout_) {
+        ESP_LOGD(TAG, "Fermeture d'une connexion FTP inactive");
+        stale = proxy->detach_session(session);
+      } else if (now - session.last_check < proxy->keepalive_interval_) {
+        continue;
+      } else {
+        // Réservée pendant le NOOP pour qu'aucune requête ne la prenne
+        session.in_use = true;
+      }
+    }
+
+    if (stale < 0) {
+      bool ok = proxy->ftp_command(session, "NOOP") / 100 == 2;
+      LockGuard lock(proxy->pool_mutex_);
+      if (!ok) {
+        ESP_LOGW(TAG, "Connexion FTP perdue (NOOP), fermeture");
+        stale = proxy->detach_session(session);
+      }
+      session.last_check = millis();
+      session.in_use = false;
+    }
+    quit_control(stale);
+  }
+  proxy->pool_maintaining_ = false;
+  vTaskDelete(nullptr);
+}
+
+bool FTPHTTPProxy::send_commands(FTPSession &session, const std::string &commands) {
+  size_t sent = 0;
+  while (sent < commands.size()) {
+    int n = sock_send(session.sock, commands.data() + sent, commands.size() - sent);
+    if (n < 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+int FTPHTTPProxy::read_reply(FTPSession &session, std::string *text) {
+  // Une réponse peut arriver en plusieurs morceaux, ou plusieurs réponses
+  // (commandes enchaînées) dans un seul recv : session.rx garde le surplus
+  size_t pos = 0;
+  int code = 0;
+  while (true) {
+    size_t eol = session.rx.find("\r\n", pos);
+    if (eol == std::string::npos) {
+      if (session.rx.size() > 4096) {
+        ESP_LOGW(TAG, "Réponse FTP trop longue");
+        return 0;
+      }
+      char buffer[256];
+      int n = sock_recv(session.sock, buffer, sizeof(buffer));
+      if (n <= 0) {
+        return 0;
+      }
+      session.rx.append(buffer, n);
+      continue;
+    }
+
+    // RFC 959 §4.2 : "xyz texte", ou "xyz-texte" ... jusqu'à la ligne "xyz texte"
+    const char *line = session.rx.c_str() + pos;
+    size_t len = eol - pos;
+    int line_code = -1;
+    char separator = len > 3 ? line[3] : ' ';
+    if (len >= 3 && isdigit((unsigned char) line[0]) && isdigit((unsigned char) line[1]) &&
+        isdigit((unsigned char) line[2]) && (separator == ' ' || separator == '-')) {
+      line_code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+    }
+
+    bool first = pos == 0;
+    pos = eol + 2;
+    if (first) {
+      if (line_code < 0) {
+        ESP_LOGW(TAG, "Réponse FTP invalide : %.*s", (int) len, line);
+        return 0;
+      }
+      code = line_code;
+      if (separator != '-') {
+        break;
+      }
+    } else if (line_code == code && separator == ' ') {
+      break;
+    }
+  }
+
+  if (text != nullptr) {
+    text->assign(session.rx, 0, pos);
+  }
+  session.rx.erase(0, pos);
+  if (session.trace != nullptr) {
+    session.trace->add_code(code);
+  }
+  return code;
+}
+
+int FTPHTTPProxy::ftp_command(FTPSession &session, const std::string &cmd, std::string *text) {
+  if (!send_commands(session, cmd + "\r\n")) {
+    return 0;
+  }
+  return read_reply(session, text);
+}
+
+bool FTPHTTPProxy::resolve_server(const Upstream &upstream, ResolvedServer &result) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char port[8];
+  snprintf(port, sizeof(port), "%u", upstream.port);
+
+  struct addrinfo *res = nullptr;
+  int err = getaddrinfo(upstream.host.c_str(), port, &hints, &res);
+  if (err != 0 || res == nullptr) {
+    ESP_LOGE(TAG, "Échec de la résolution DNS de %s : %d", upstream.host.c_str(), err);
+    return false;
+  }
+
+  // IPv4 d'abord, IPv6 en repli
+  result.count = 0;
+  for (int family : {AF_INET, AF_INET6}) {
+    for (struct addrinfo *ai = res; ai != nullptr && result.count < ResolvedServer::MAX_ADDRESSES; ai = ai->ai_next) {
+      if (ai->ai_family == family && ai->ai_addrlen <= sizeof(struct sockaddr_storage)) {
+        memcpy(&result.addrs[result.count], ai->ai_addr, ai->ai_addrlen);
+        result.lens[result.count] = ai->ai_addrlen;
+        result.count++;
+      }
+    }
+  }
+  freeaddrinfo(res);
+  result.resolved_at = millis();
+  return result.count > 0;
+}
+
+bool FTPHTTPProxy::server_addresses(uint8_t index, ResolvedServer &result, bool force) {
+  Upstream &upstream = upstreams_[index];
+  if (!force) {
+    LockGuard lock(dns_mutex_);
+    if (upstream.dns.count > 0 && millis() - upstream.dns.resolved_at < dns_ttl_) {
+      result = upstream.dns;
+      return true;
+    }
+  }
+
+  ResolvedServer fresh;
+  bool ok = resolve_server(upstream, fresh);
+  LockGuard lock(dns_mutex_);
+  if (ok) {
+    upstream.dns = fresh;
+  } else if (upstream.dns.count == 0) {
+    return false;
+  }
+  // Sans réponse DNS, l'ancienne adresse vaut mieux que rien
+  result = upstream.dns;
+  return true;
+}
+
+void FTPHTTPProxy::dns_refresh_task(void *arg) {
+  auto *proxy = static_cast<FTPHTTPProxy *>(arg);
+  for (auto &upstream : proxy->upstreams_) {
+    {
+      LockGuard lock(proxy->dns_mutex_);
+      if (upstream.dns.count > 0 && millis() - upstream.dns.resolved_at < proxy->dns_ttl_ / 4 * 3) {
+        continue;
+      }
+    }
+    ResolvedServer fresh;
+    if (proxy->resolve_server(upstream, fresh)) {
+      LockGuard lock(proxy->dns_mutex_);
+      upstream.dns = fresh;
+    }
+  }
+  proxy->dns_refreshing_ = false;
+  vTaskDelete(nullptr);
+}
+
+int FTPHTTPProxy::connect_with_timeout(const struct sockaddr *addr, socklen_t len) {
+  int sock = ::socket(addr->sa_family, SOCK_STREAM, 0);
+  if (sock < 0) {
+    ESP_LOGE(TAG, "Échec de création du socket : %d", errno);
+    return -1;
+  }
+
+  // connect() non bloquant borné par connect_timeout
+  int flags = fcntl(sock, F_GETFL, 0);
+  fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+  int err = 0;
+  if (::connect(sock, addr, len) != 0) {
+    if (errno != EINPROGRESS) {
+      err = errno;
+    } else {
+      fd_set write_fds;
+      FD_ZERO(&write_fds);
+      FD_SET(sock, &write_fds);
+      struct timeval tv;
+      tv.tv_sec = connect_timeout_ / 1000;
+      tv.tv_usec = (connect_timeout_ % 1000) * 1000;
+      int ready = select(sock + 1, nullptr, &write_fds, nullptr, &tv);
+      if (ready <= 0) {
+        err = ready == 0 ? ETIMEDOUT : errno;
+      } else {
+        socklen_t err_len = sizeof(err);
+        getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len);
+      }
+    }
+  }
+  if (err != 0) {
+    ESP_LOGW(TAG, "Échec de connexion : %d", err);
+    ::close(sock);
+    return -1;
+  }
+  fcntl(sock, F_SETFL, flags);
+
+  // Un serveur muet ne doit pas bloquer indéfiniment
+  struct timeval timeout = {.tv_sec = 10, .tv_usec = 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return sock;
+}
+
+bool FTPHTTPProxy::connect_to_ftp(FTPSession &session) {
+  const Upstream &upstream = upstreams_[session.upstream];
+  ResolvedServer server;
+  int sock = -1;
+  ConnectTimings timings;
+
+  // Seconde passe avec une résolution neuve : l'adresse a pu changer
+  for (int pass = 0; pass < 2 && sock < 0; pass++) {
+    uint32_t started = millis();
+    bool resolved = server_addresses(session.upstream, server, pass > 0);
+    timings.dns += millis() - started;
+    if (!resolved) {
+      return false;
+    }
+    started = millis();
+    for (uint8_t i = 0; i < server.count && sock < 0; i++) {
+      sock = connect_with_timeout((struct sockaddr *) &server.addrs[i], server.lens[i]);
+      if (sock >= 0) {
+        session.peer = server.addrs[i];
+        session.peer_len = server.lens[i];
+      }
+    }
+    timings.connect += millis() - started;
+  }
+  if (sock < 0) {
+    ESP_LOGE(TAG, "Échec de connexion FTP à %s:%u", upstream.host.c_str(), upstream.port);
+    return false;
+  }
+
+  session.sock = sock;
+  session.rx.clear();
+  uint32_t login_started = millis();
+  if (read_reply(session) != 220) {
+    ESP_LOGE(TAG, "Message de bienvenue FTP non reçu");
+    close_session(session);
+    return false;
+  }
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  if (!start_control_tls(session)) {
+    close_session(session);
+    return false;
+  }
+#endif
+
+  // Authentification puis mode binaire, envoyés d'un bloc : un seul aller-retour.
+  // En FTPS, PBSZ/PROT P (canal de données chiffré) suivent dans le même envoi
+  std::string login = "USER " + upstream.username + "\r\nPASS " + upstream.password + "\r\nTYPE I\r\n";
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  login += "PBSZ 0\r\nPROT P\r\n";
+#endif
+  int user_code = 0, pass_code = 0, type_code = 0, prot_code = 200;
+  bool sent = send_commands(session, login);
+  if (sent) {
+    user_code = read_reply(session);
+    pass_code = read_reply(session);
+    type_code = read_reply(session);
+#ifdef USE_FTP_HTTP_PROXY_TLS
+    int pbsz_code = read_reply(session);
+    prot_code = read_reply(session);
+    if (pbsz_code / 100 != 2) {
+      prot_code = pbsz_code;
+    }
+#endif
+  }
+  // 230 dès USER : pas de mot de passe demandé, la réponse à PASS est ignorée
+  bool logged_in = user_code == 230 || (user_code == 331 && pass_code / 100 == 2);
+  if (!logged_in || type_code / 100 != 2 || prot_code / 100 != 2) {
+    ESP_LOGE(TAG, "Échec de l'authentification FTP sur %s (%d/%d/%d)", upstream.host.c_str(), user_code, pass_code,
+             type_code);
+    close_session(session);
+    return false;
+  }
+
+  session.last_used = millis();
+  session.last_check = session.last_used;
+  timings.login = session.last_used - login_started;
+  session.timings = timings;
+  metrics_.observe(PHASE_DNS, timings.dns);
+  metrics_.observe(PHASE_CONNECT, timings.connect);
+  metrics_.observe(PHASE_LOGIN, timings.login);
+  return true;
+}
+
+#ifdef USE_FTP_HTTP_PROXY_TLS
+bool FTPHTTPProxy::setup_tls() {
+  mbedtls_ssl_config_init(&tls_conf_);
+  if (mbedtls_ssl_config_defaults(&tls_conf_, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                  MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+    return false;
+  }
+  // TLS 1.2 : la session est connue dès la fin de la poignée de main, ce que
+  // supposent les serveurs FTPS qui exigent sa reprise sur le canal de données
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+  mbedtls_ssl_conf_max_tls_version(&tls_conf_, MBEDTLS_SSL_VERSION_TLS1_2);
+#else
+  // mbedTLS 2.x (ESP-IDF 4.x) : pas de TLS 1.3, TLS 1.2 est déjà le maximum
+  mbedtls_ssl_conf_max_version(&tls_conf_, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+#endif
+  mbedtls_ssl_conf_rng(&tls_conf_, tls_random, nullptr);
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+  mbedtls_ssl_conf_session_tickets(&tls_conf_, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+  if (!tls_verify_) {
+    // Serveur de test au certificat auto-signé
+    mbedtls_ssl_conf_authmode(&tls_conf_, MBEDTLS_SSL_VERIFY_NONE);
+    return true;
+  }
+  mbedtls_ssl_conf_authmode(&tls_conf_, MBEDTLS_SSL_VERIFY_REQUIRED);
+  return esp_crt_bundle_attach(&tls_conf_) == ESP_OK;
+}
+
+bool FTPHTTPProxy::start_tls(int sock, const std::string &host, const TlsSession *resume, TlsSession *saved) {
+  auto *channel = new TlsChannel();
+  if (!channel->handshake(sock, &tls_conf_, host.c_str(), resume) ||
+      (saved != nullptr && !channel->save_session(*saved))) {
+    delete channel;
+    return false;
+  }
+  LockGuard lock(tls_channels_mutex);
+  tls_channels[sock] = channel;
+  return true;
+}
+
+bool FTPHTTPProxy::start_control_tls(FTPSession &session) {
+  // Jamais d'identifiants en clair : sans AUTH TLS, pas de connexion
+  Upstream &upstream = upstreams_[session.upstream];
+  if (ftp_command(session, "AUTH TLS") != 234) {
+    ESP_LOGE(TAG, "AUTH TLS refusé par %s", upstream.host.c_str());
+    return false;
+  }
+
+  // Reprise de la dernière session négociée avec cet amont : une reconnexion
+  // du pool évite l'échange de clés complet
+  std::shared_ptr<TlsSession> resume;
+  {
+    LockGuard lock(pool_mutex_);
+    resume = upstream.tls_session;
+  }
+  auto saved = std::make_shared<TlsSession>();
+  if (!start_tls(session.sock, upstream.host, resume.get(), saved.get())) {
+    return false;
+  }
+  session.tls_session = saved;
+  LockGuard lock(pool_mutex_);
+  upstream.tls_session = saved;
+  return true;
+}
+#endif
+
+bool FTPHTTPProxy::secure_data(FTPSession &session, int data_sock) {
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  // Le serveur ne négocie TLS sur le canal de données qu'après la commande de
+  // transfert, d'où l'appel après la réponse 1xx. La session du canal de
+  // contrôle est reprise : handshake abrégé, et exigé par certains serveurs
+  if (!start_tls(data_sock, upstreams_[session.upstream].host, session.tls_session.get(), nullptr)) {
+    ESP_LOGW(TAG, "Canal de données TLS refusé");
+    return false;
+  }
+#endif
+  return true;
+}
+
+int FTPHTTPProxy::pick_upstream(uint32_t tried) const {
+  // Amont sain d'abord, puis charge rapportée au poids la plus faible ; à
+  // charge nulle, le poids le plus fort l'emporte
+  int best = -1;
+  for (uint8_t i = 0; i < upstreams_.size(); i++) {
+    if (tried & (1u << i)) {
+      continue;
+    }
+    if (best < 0) {
+      best = i;
+      continue;
+    }
+    const Upstream &candidate = upstreams_[i];
+    const Upstream &current = upstreams_[best];
+    if (candidate.healthy != current.healthy) {
+      if (candidate.healthy) {
+        best = i;
+      }
+    } else if ((candidate.outstanding + 1) * current.weight < (current.outstanding + 1) * candidate.weight) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+FTPSession *FTPHTTPProxy::claim_slot(uint8_t upstream, int &stale_sock) {
+  // Priorité à une connexion déjà authentifiée vers cet amont, puis à un
+  // emplacement libre, enfin à une connexion inactive vers un autre amont
+  FTPSession *slot = nullptr;
+  for (auto &session : pool_) {
+    if (!session.in_use && session.sock >= 0 && session.upstream == upstream) {
+      slot = &session;
+      break;
+    }
+  }
+  for (auto &session : pool_) {
+    if (slot == nullptr && !session.in_use && session.sock < 0) {
+      slot = &session;
+    }
+  }
+  // Appelé sous pool_mutex_ : l'ancienne connexion est fermée par l'appelant
+  for (auto &session : pool_) {
+    if (slot == nullptr && !session.in_use) {
+      stale_sock = detach_session(session);
+      slot = &session;
+    }
+  }
+
+  if (slot != nullptr) {
+    slot->in_use = true;
+    slot->upstream = upstream;
+    upstreams_[upstream].outstanding++;
+  }
+  return slot;
+}
+
+void FTPHTTPProxy::mark_upstream(uint8_t index, bool healthy) {
+  Upstream &upstream = upstreams_[index];
+  if (upstream.healthy != healthy) {
+    ESP_LOGW(TAG, "Serveur FTP %s:%u %s", upstream.host.c_str(), upstream.port,
+             healthy ? "de nouveau disponible" : "indisponible");
+  }
+  upstream.healthy = healthy;
+  upstream.checked_at = millis();
+}
+
+int8_t FTPHTTPProxy::upstream_mode_z(const FTPSession &session) {
+  LockGuard lock(pool_mutex_);
+  return upstreams_[session.upstream].mode_z;
+}
+
+void FTPHTTPProxy::health_check_task(void *arg) {
+  auto *proxy = static_cast<FTPHTTPProxy *>(arg);
+
+  // Seuls les amonts sans connexion ouverte sont sondés : les autres sont
+  // déjà surveillés par le NOOP du pool
+  for (uint8_t i = 0; i < proxy->upstreams_.size(); i++) {
+    {
+      LockGuard lock(proxy->pool_mutex_);
+      const Upstream &upstream = proxy->upstreams_[i];
+      bool connected = std::any_of(proxy->pool_.begin(), proxy->pool_.end(), [i](const FTPSession &session) {
+        return session.upstream == i && session.sock >= 0;
+      });
+      if ((connected && upstream.healthy) || millis() - upstream.checked_at < proxy->health_check_interval_) {
+        continue;
+      }
+    }
+
+    FTPSession probe;
+    probe.upstream = i;
+    bool ok = proxy->connect_to_ftp(probe);
+    proxy->close_session(probe);
+    LockGuard lock(proxy->pool_mutex_);
+    proxy->mark_upstream(i, ok);
+  }
+
+  proxy->health_checking_ = false;
+  vTaskDelete(nullptr);
+}
+
+FTPSession *FTPHTTPProxy::acquire_session(bool &reused) {
+  FTPSession *slot = nullptr;
+  uint32_t tried = 0;  // masque des amonts déjà essayés
+
+  // Toutes les connexions peuvent être prises par d'autres transferts ou par
+  // le NOOP de keepalive_task : on patiente un peu avant d'abandonner
+  uint32_t started = millis();
+  int stale = -1;
+  for (int attempt = 0; slot == nullptr && millis() - started < 5000; attempt++) {
+    if (attempt > 0) {
+      vTaskDelay(pdMS_TO_TICKS(20));
+    }
+    LockGuard lock(pool_mutex_);
+    slot = claim_slot(pick_upstream(tried), stale);
+  }
+  quit_control(stale);
+
+  if (slot == nullptr) {
+    ESP_LOGW(TAG, "Pool de connexions FTP saturé");
+    return nullptr;
+  }
+
+  while (true) {
+    reused = slot->sock >= 0;
+    if (reused && !session_alive(*slot)) {
+      ESP_LOGD(TAG, "Connexion FTP fermée par le serveur, reconnexion");
+      close_session(*slot);
+      reused = false;
+    }
+    if (reused) {
+      return slot;
+    }
+    bool connected = connect_to_ftp(*slot);
+
+    LockGuard lock(pool_mutex_);
+    mark_upstream(slot->upstream, connected);
+    if (connected) {
+      return slot;
+    }
+
+    // Amont injoignable : bascule transparente sur le suivant
+    tried |= 1u << slot->upstream;
+    upstreams_[slot->upstream].outstanding--;
+    int next = pick_upstream(tried);
+    if (next < 0) {
+      slot->in_use = false;
+      return nullptr;
+    }
+    slot->upstream = next;
+    upstreams_[next].outstanding++;
+  }
+}
+
+void FTPHTTPProxy::release_session(FTPSession *session, bool reusable) {
+  int stale = -1;
+  {
+    LockGuard lock(pool_mutex_);
+    upstreams_[session->upstream].outstanding--;
+    session->trace = nullptr;
+    if (!reusable) {
+      stale = detach_session(*session);
+    } else {
+      session->last_used = millis();
+      session->last_check = session->last_used;
+    }
+    session->in_use = false;
+  }
+  quit_control(stale);
+}
+
+void FTPHTTPProxy::close_session(FTPSession &session) { quit_control(detach_session(session)); }
+
+int FTPHTTPProxy::detach_session(FTPSession &session) {
+  // Remise à zéro sans E/S, possible sous pool_mutex_ ; le socket rendu est
+  // fermé ensuite par quit_control()
+  int sock = session.sock;
+  session.sock = -1;
+  session.rx.clear();
+  session.mode_z = false;
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  session.tls_session.reset();
+#endif
+  return sock;
+}
+
+bool FTPHTTPProxy::session_alive(const FTPSession &session) {
+  // Sans requête en cours, le serveur n'a rien à nous dire : des données
+  // en attente (421, alerte TLS ...) ou une fin de flux signifient une
+  // connexion morte
+  if (!session.rx.empty()) {
+    return false;
+  }
+  char c;
+  int n = recv(session.sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (n < 0) {
+    return errno == EWOULDBLOCK || errno == EAGAIN;
+  }
+  return false;
+}
+
+const char *FTPHTTPProxy::passive_command(const FTPSession &session) {
+  // EPSV (RFC 2428) en IPv6 : PASV ne sait décrire qu'une adresse IPv4
+  return session.peer.ss_family == AF_INET6 ? "EPSV\r\n" : "PASV\r\n";
+}
+
+int FTPHTTPProxy::open_data_connection(FTPSession &session) {
+  // La commande passive_command() a déjà été envoyée, éventuellement à la suite d'autres
+  std::string response;
+  struct sockaddr_storage data_addr = session.peer;
+  int code = read_reply(session, &response);
+
+  if (session.peer.ss_family == AF_INET6) {
+    // EPSV : seul le port est donné, l'adresse est celle du serveur
+    int data_port;
+    size_t epsv_start = response.find('(');
+    if (code != 229 || epsv_start == std::string::npos ||
+        sscanf(response.c_str() + epsv_start, "(|||%d|)", &data_port) != 1) {
+      return -1;
+    }
+    ((struct sockaddr_in6 *) &data_addr)->sin6_port = htons(data_port);
+  } else {
+    // Mode passif : extraction des données de connexion
+    int ip[4], port[2];
+    size_t pasv_start = response.find('(');
+    if (code != 227 || pasv_start == std::string::npos ||
+        sscanf(response.c_str() + pasv_start, "(%d,%d,%d,%d,%d,%d)", &ip[0], &ip[1], &ip[2], &ip[3], &port[0],
+               &port[1]) != 6) {
+      return -1;
+    }
+    auto *addr = (struct sockaddr_in *) &data_addr;
+    addr->sin_port = htons(port[0] * 256 + port[1]);
+    addr->sin_addr.s_addr = htonl(
+        (ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3]
+    );
+  }
+
+  // Création du socket de données
+  return connect_with_timeout((struct sockaddr *) &data_addr, session.peer_len);
+}
+
+std::string FTPHTTPProxy::stat_commands(const std::string &remote_path) {
+  return "SIZE " + remote_path + "\r\nMDTM " + remote_path + "\r\n";
+}
+
+bool FTPHTTPProxy::read_stat_replies(FTPSession &session, RemoteFileInfo &info) {
+  std::string response;
+  int code = read_reply(session, &response);
+  if (code == 0) {
+    return false;
+  }
+  char *end;
+  info.size = code == 213 ? strtoul(response.c_str() + 4, &end, 10) : 0;
+  info.has_size = code == 213 && end != response.c_str() + 4;
+
+  code = read_reply(session, &response);
+  if (code == 0) {
+    return false;
+  }
+  // MDTM est en UTC (RFC 3659) ; 0 si la commande n'est pas supportée
+  int y, mo, d, hh, mi, ss;
+  info.mtime = 0;
+  if (code == 213 && sscanf(response.c_str() + 4, "%4d%2d%2d%2d%2d%2d", &y, &mo, &d, &hh, &mi, &ss) == 6) {
+    info.mtime = utc_to_time(y, mo, d, hh, mi, ss);
+  }
+  return true;
+}
+
+bool FTPHTTPProxy::relay_data(int data_sock, size_t &remaining, const RelaySink &sink) {
+  // Lecture FTP et envoi HTTP en parallèle quand le tampon le permet
+  if (buffer_count_ > 1) {
+    RelayPipe pipe;
+    if (pipe.init(chunk_size_, buffer_count_) && pipe.start(data_sock, remaining)) {
+      return pipe.drain(sink, remaining);
+    }
+    ESP_LOGW(TAG, "Tampon de relais indisponible, transfert séquentiel");
+  }
+
+  std::vector<char> buffer(chunk_size_);
+  while (remaining > 0) {
+    int bytes_received = sock_recv(data_sock, buffer.data(), std::min(buffer.size(), remaining));
+    if (bytes_received <= 0) break;
+
+    if (!sink(buffer.data(), bytes_received)) {
+      return false;
+    }
+    if (remaining != SIZE_MAX) {
+      remaining -= bytes_received;
+    }
+  }
+  return true;
+}
+
+bool FTPHTTPProxy::apply_file_info(const RemoteFileInfo &info, const ByteRange &range, ResponseStream &out,
+                                   size_t &start, size_t &remaining) {
+  char buffer[64];
+  start = 0;
+  remaining = SIZE_MAX;
+
+  add_validators(info, out);
+
+  // Sans SIZE, la réponse part en chunked et l'en-tête Range est ignoré :
+  // on renvoie le fichier complet, comme l'autorise la RFC 9110
+  if (!info.has_size) {
+    return true;
+  }
+  size_t total = info.size;
+  out.set_content_length(total);
+  if (!range.requested) {
+    return true;
+  }
+
+  size_t end = total - 1;
+  if (range.suffix) {
+    start = range.start >= total ? 0 : total - range.start;
+  } else {
+    start = range.start;
+    end = std::min(range.end, total - 1);
+  }
+  if (total == 0 || start >= total) {
+    snprintf(buffer, sizeof(buffer), "bytes */%u", (unsigned) total);
+    out.set_status("416 Range Not Satisfiable");
+    out.add_header("Content-Range", buffer);
+    out.set_content_length(0);
+    return false;
+  }
+
+  // Une plage qui va jusqu'à la fin se lit jusqu'à l'EOF
+  if (end < total - 1) {
+    remaining = end - start + 1;
+  }
+  snprintf(buffer, sizeof(buffer), "bytes %u-%u/%u", (unsigned) start, (unsigned) end, (unsigned) total);
+  out.set_status("206 Partial Content");
+  out.add_header("Content-Range", buffer);
+  out.set_content_length(end - start + 1);
+  return true;
+}
+
+void FTPHTTPProxy::add_validators(const RemoteFileInfo &info, ResponseStream &out, bool compressed) {
+  char buffer[48];
+  if (info.mtime == 0) {
+    return;
+  }
+  struct tm tm;
+  gmtime_r(&info.mtime, &tm);
+  strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  out.add_header("Last-Modified", buffer);
+  if (info.has_size) {
+    format_etag(info, buffer, sizeof(buffer), compressed);
+    out.add_header("ETag", buffer);
+  }
+}
+
+bool FTPHTTPProxy::meta_lookup(const std::string &remote_path, RemoteFileInfo &info) {
+  LockGuard lock(meta_mutex_);
+  auto it = meta_cache_.find(remote_path);
+  if (it == meta_cache_.end() || millis() - it->second.fetched_at >= metadata_ttl_) {
+    return false;
+  }
+  info = it->second.info;
+  return true;
+}
+
+// Chemins fournis par les clients, échecs 550 compris : le cache est borné
+static const size_t META_CACHE_MAX = 64;
+
+void FTPHTTPProxy::meta_store(const std::string &remote_path, const RemoteFileInfo &info) {
+  LockGuard lock(meta_mutex_);
+  if (meta_cache_.size() >= META_CACHE_MAX && meta_cache_.find(remote_path) == meta_cache_.end()) {
+    // Entrées expirées d'abord, puis la plus ancienne si le cache reste plein
+    uint32_t now = millis();
+    auto oldest = meta_cache_.end();
+    for (auto it = meta_cache_.begin(); it != meta_cache_.end();) {
+      if (now - it->second.fetched_at >= metadata_ttl_) {
+        it = meta_cache_.erase(it);
+        continue;
+      }
+      if (oldest == meta_cache_.end() || now - it->second.fetched_at > now - oldest->second.fetched_at) {
+        oldest = it;
+      }
+      ++it;
+    }
+    if (meta_cache_.size() >= META_CACHE_MAX) {
+      meta_cache_.erase(oldest);
+    }
+  }
+  MetaEntry &entry = meta_cache_[remote_path];
+  entry.info = info;
+  entry.fetched_at = millis();
+}
+
+bool FTPHTTPProxy::get_file_info(const std::string &remote_path, RemoteFileInfo &info) {
+  if (meta_lookup(remote_path, info) || listing_file_info(remote_path, info)) {
+    return true;
+  }
+  {
+    // Fichier préchargé et revalidé depuis moins d'un intervalle
+    LockGuard lock(ram_mutex_);
+    auto it = ram_cache_.find(remote_path);
+    if (it != ram_cache_.end() && millis() - it->second->validated_at < refresh_interval_) {
+      info = it->second->info;
+      return true;
+    }
+  }
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  // Une copie SD vérifiée récemment fait foi, comme pour le téléchargement
+  CacheEntry cached;
+  if (cache_lookup(remote_path, cached) && cached.validated && millis() - cached.validated_at < cache_ttl_) {
+    info.has_size = true;
+    info.size = cached.size;
+    info.mtime = cached.mtime;
+    return true;
+  }
+#endif
+
+  // Seule la connexion de contrôle est utilisée : pas de PASV
+  bool reused;
+  FTPSession *session = acquire_session(reused);
+  if (session == nullptr) {
+    return false;
+  }
+  bool ok = send_commands(*session, stat_commands(remote_path)) && read_stat_replies(*session, info);
+  release_session(session, ok);
+  if (!ok) {
+    return false;
+  }
+  meta_store(remote_path, info);
+  return true;
+}
+
+bool FTPHTTPProxy::match_listing(const char *path, size_t len) const {
+  std::string_view view(path, len);
+  // Aucun segment ".." : le préfixe autorisé ne doit pas pouvoir être quitté
+  for (size_t pos = 0; pos <= len;) {
+    size_t end = view.find('/', pos);
+    if (end == std::string_view::npos) {
+      end = len;
+    }
+    if (view.substr(pos, end - pos) == "..") {
+      return false;
+    }
+    pos = end + 1;
+  }
+  for (const auto &dir : listing_dirs_) {
+    if (dir.empty() || (view.compare(0, dir.size(), dir) == 0 && (len == dir.size() || path[dir.size()] == '/'))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::shared_ptr<DirListing> FTPHTTPProxy::listing_lookup(const std::string &dir) {
+  LockGuard lock(listing_mutex_);
+  auto it = listings_.find(dir);
+  if (it == listings_.end() || millis() - it->second->fetched_at >= listing_ttl_) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+std::shared_ptr<DirListing> FTPHTTPProxy::get_listing(const std::string &dir, int *reply) {
+  std::shared_ptr<DirListing> listing = listing_lookup(dir);
+  if (listing != nullptr) {
+    return listing;
+  }
+  listing = std::make_shared<DirListing>();
+  if (!fetch_listing(dir, *listing, reply)) {
+    return nullptr;
+  }
+  listing->fetched_at = millis();
+
+  LockGuard lock(listing_mutex_);
+  // Nombre de listings borné : le plus ancien laisse sa place
+  if (listings_.size() >= 16 && listings_.find(dir) == listings_.end()) {
+    auto oldest = listings_.begin();
+    for (auto it = listings_.begin(); it != listings_.end(); ++it) {
+      if (millis() - it->second->fetched_at > millis() - oldest->second->fetched_at) {
+        oldest = it;
+      }
+    }
+    listings_.erase(oldest);
+  }
+  listings_[dir] = listing;
+  return listing;
+}
+
+bool FTPHTTPProxy::fetch_listing(const std::string &dir, DirListing &listing, int *reply) {
+  int data_sock;
+  FTPSession *session = begin_transfer(dir, nullptr, data_sock);
+  if (session == nullptr) {
+    return false;
+  }
+
+  // Un listing ne passe jamais en MODE Z ; la commande suit le PASV déjà envoyé
+  bool use_mlsd = upstreams_[session->upstream].mlsd != 0;
+  bool reset_mode = session->mode_z;
+  std::string commands = reset_mode ? "MODE S\r\n" : "";
+  commands += use_mlsd ? "MLSD" : "LIST";
+  commands += dir.empty() ? "\r\n" : " " + dir + "\r\n";
+  if (!send_commands(*session, commands) || (reset_mode && read_reply(*session) / 100 != 2)) {
+    sock_close(data_sock);
+    release_session(session, false);
+    return false;
+  }
+  session->mode_z = false;
+
+  int code = read_reply(*session);
+  if (use_mlsd && (code == 500 || code == 502)) {
+    // Serveur sans MLSD : LIST, désormais, sur cet amont
+    sock_close(data_sock);
+    {
+      LockGuard lock(pool_mutex_);
+      upstreams_[session->upstream].mlsd = 0;
+    }
+    release_session(session, true);
+    return fetch_listing(dir, listing, reply);
+  }
+  if (code / 100 != 1) {
+    if (reply != nullptr) {
+      *reply = code;
+    }
+    sock_close(data_sock);
+    release_session(session, code / 100 == 4 || code / 100 == 5);
+    return false;
+  }
+  if (!secure_data(*session, data_sock)) {
+    sock_close(data_sock);
+    release_session(session, false);
+    return false;
+  }
+  if (use_mlsd) {
+    LockGuard lock(pool_mutex_);
+    upstreams_[session->upstream].mlsd = 1;
+  }
+
+  // Listing complet en mémoire, borné pour un répertoire démesuré
+  std::string data;
+  size_t remaining = 262144;
+  bool relay_ok = relay_data(data_sock, remaining, [&](const char *chunk, size_t len) {
+    data.append(chunk, len);
+    return true;
+  });
+  sock_close(data_sock);
+  bool truncated = remaining == 0;
+  if (!end_transfer(session, relay_ok, truncated) || truncated) {
+    ESP_LOGW(TAG, "Listing de /%s incomplet", dir.c_str());
+    return false;
+  }
+
+  for (size_t pos = 0; pos < data.size();) {
+    size_t eol = data.find('\n', pos);
+    if (eol == std::string::npos) {
+      eol = data.size();
+    }
+    size_t end = eol > pos && data[eol - 1] == '\r' ? eol - 1 : eol;
+    std::string line = data.substr(pos, end - pos);
+    pos = eol + 1;
+
+    DirEntry entry;
+    if (use_mlsd ? parse_mlsd_line(line, entry) : parse_list_line(line, entry)) {
+      listing.entries.push_back(std::move(entry));
+    }
+  }
+  return true;
+}
+
+bool FTPHTTPProxy::parse_mlsd_line(const std::string &line, DirEntry &entry) {
+  // RFC 3659 §7.2 : "fait=valeur;fait=valeur; nom"
+  size_t space = line.find(' ');
+  if (space == std::string::npos || space + 1 >= line.size()) {
+    return false;
+  }
+  entry.name = line.substr(space + 1);
+
+  bool known_type = false;
+  for (size_t pos = 0; pos < space;) {
+    size_t end = line.find(';', pos);
+    if (end == std::string::npos || end > space) {
+      end = space;
+    }
+    size_t eq = line.find('=', pos);
+    if (eq != std::string::npos && eq < end) {
+      std::string fact = line.substr(pos, eq - pos);
+      std::string value = line.substr(eq + 1, end - eq - 1);
+      std::transform(fact.begin(), fact.end(), fact.begin(), ::tolower);
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      int y, mo, d, hh, mi, ss;
+      if (fact == "type") {
+        // cdir et pdir (le répertoire lui-même et son parent) sont écartés
+        known_type = value == "file" || value == "dir";
+        entry.is_dir = value == "dir";
+      } else if (fact == "size") {
+        entry.size = strtoul(value.c_str(), nullptr, 10);
+        entry.has_size = true;
+      } else if (fact == "modify" &&
+                 sscanf(value.c_str(), "%4d%2d%2d%2d%2d%2d", &y, &mo, &d, &hh, &mi, &ss) == 6) {
+        entry.mtime = utc_to_time(y, mo, d, hh, mi, ss);
+      }
+    }
+    pos = end + 1;
+  }
+  return known_type;
+}
+
+bool FTPHTTPProxy::parse_list_line(const std::string &line, DirEntry &entry) {
+  // Format Unix : "drwxr-xr-x 2 owner group 4096 Jan 01 12:00 nom" ; la date
+  // (heure locale du serveur, sans année ou sans heure) n'est pas retenue
+  char perms[11], month[4], when[6];
+  unsigned long size;
+  int day, name_pos = 0;
+  if (sscanf(line.c_str(), "%10s %*s %*s %*s %lu %3s %d %5s %n", perms, &size, month, &day, when, &name_pos) != 5 ||
+      name_pos == 0 || (size_t) name_pos >= line.size()) {
+    return false;
+  }
+  if (perms[0] != '-' && perms[0] != 'd') {
+    return false;
+  }
+  entry.name = line.substr(name_pos);
+  entry.is_dir = perms[0] == 'd';
+  entry.has_size = !entry.is_dir;
+  entry.size = size;
+  return entry.name != "." && entry.name != "..";
+}
+
+bool FTPHTTPProxy::listing_file_info(const std::string &remote_path, RemoteFileInfo &info) {
+  // Seuls les faits de MLSD font foi : sans date, l'ETag différerait de celui
+  // d'un téléchargement
+  size_t slash = remote_path.rfind('/');
+  std::string dir = slash == std::string::npos ? std::string() : remote_path.substr(0, slash);
+  std::shared_ptr<DirListing> listing = listing_lookup(dir);
+  if (listing == nullptr) {
+    return false;
+  }
+  const char *name = remote_path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+  for (const auto &entry : listing->entries) {
+    if (!entry.is_dir && entry.has_size && entry.mtime != 0 && entry.name == name) {
+      info.has_size = true;
+      info.size = entry.size;
+      info.mtime = entry.mtime;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void append_json_string(std::string &out, const std::string &value) {
+  out += '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char) c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+bool FTPHTTPProxy::serve_listing(const std::string &dir, ResponseStream &out, bool head) {
+  int reply = 0;
+  std::shared_ptr<DirListing> listing = get_listing(dir, &reply);
+  if (listing == nullptr) {
+    // 550 : répertoire absent ; tout autre échec vient du serveur FTP
+    return send_error_page(out, reply == 550 ? "404 Not Found" : "502 Bad Gateway", head);
+  }
+
+  // Objet JSON : {"path":"/dir/","entries":[{"name","type","size","mtime"}, ...]},
+  // size et mtime absents quand le serveur ne les fournit pas
+  std::string body = "{\"path\":";
+  append_json_string(body, "/" + dir + (dir.empty() ? "" : "/"));
+  body += ",\"entries\":[";
+  char number[24];
+  for (size_t i = 0; i < listing->entries.size(); i++) {
+    const DirEntry &entry = listing->entries[i];
+    body += i > 0 ? ",{\"name\":" : "{\"name\":";
+    append_json_string(body, entry.name);
+    body += entry.is_dir ? ",\"type\":\"dir\"" : ",\"type\":\"file\"";
+    if (entry.has_size) {
+      snprintf(number, sizeof(number), "%u", (unsigned) entry.size);
+      body += ",\"size\":";
+      body += number;
+    }
+    if (entry.mtime != 0) {
+      snprintf(number, sizeof(number), "%lld", (long long) entry.mtime);
+      body += ",\"mtime\":";
+      body += number;
+    }
+    body += '}';
+  }
+  body += "]}";
+
+  out.set_content_type("application/json");
+  if (head) {
+    out.add_header("Content-Length", std::to_string(body.size()));
+    out.set_no_body();
+    return out.finish();
+  }
+  out.set_content_length(body.size());
+  return out.write(body.c_str(), body.size()) && out.finish();
+}
+
+bool FTPHTTPProxy::serve_head(const std::string &remote_path, ResponseStream &out) {
+  // Métadonnées en cache (listing, SIZE/MDTM, RAM, SD) : souvent aucun échange FTP
+  RemoteFileInfo info;
+  if (!get_file_info(remote_path, info)) {
+    return send_error_page(out, "502 Bad Gateway", true);
+  }
+  if (!info.has_size && info.mtime == 0) {
+    out.set_status("404 Not Found");
+  } else {
+    add_validators(info, out);
+    if (info.has_size) {
+      out.add_header("Content-Length", std::to_string(info.size));
+    }
+  }
+  out.set_no_body();
+  return out.finish();
+}
+
+bool FTPHTTPProxy::send_error_page(ResponseStream &out, const char *status, bool head) {
+  // Réponse complète plutôt qu'une connexion coupée sans code d'état
+  out.set_status(status);
+  out.set_content_type("text/plain");
+  if (head) {
+    out.set_no_body();
+    return out.finish();
+  }
+  out.set_content_length(strlen(status));
+  return out.write(status, strlen(status)) && out.finish();
+}
+
+bool FTPHTTPProxy::send_not_modified(const std::string &remote_path, const ConditionalRequest &conditional,
+                                     ResponseStream &out) {
+  RemoteFileInfo info;
+  if (!get_file_info(remote_path, info) || info.mtime == 0) {
+    return false;
+  }
+
+  // If-None-Match l'emporte sur If-Modified-Since (RFC 9110 §13.2.2)
+  bool not_modified;
+  if (!conditional.if_none_match.empty()) {
+    char etag[32], etag_z[32];
+    format_etag(info, etag, sizeof(etag));
+    format_etag(info, etag_z, sizeof(etag_z), true);
+    not_modified = info.has_size && (conditional.if_none_match == "*" ||
+                                     conditional.if_none_match.find(etag) != std::string::npos ||
+                                     (mode_z_ && conditional.if_none_match.find(etag_z) != std::string::npos));
+  } else {
+    not_modified = info.mtime <= conditional.if_modified_since;
+  }
+  if (!not_modified) {
+    return false;
+  }
+
+  out.set_status("304 Not Modified");
+  out.set_no_body();
+  add_validators(info, out);
+  return out.finish();
+}
+
+bool FTPHTTPProxy::download_file(const std::string &remote_path, ResponseStream &out, const ByteRange &range,
+                                 bool accept_deflate, bool coalesce) {
+  // Fichier préchargé en RAM : aucun échange FTP
+  std::shared_ptr<RamFile> ram = ram_lookup(remote_path);
+  if (ram != nullptr) {
+    out.set_source(SOURCE_RAM);
+    return serve_ram_file(*ram, out, range);
+  }
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  // Copie sur la carte SD vérifiée récemment : aucun échange FTP
+  CacheEntry cached;
+  if (cache_lookup(remote_path, cached) && cached.validated && millis() - cached.validated_at < cache_ttl_) {
+    out.set_source(SOURCE_SD);
+    return serve_cached_file(remote_path, cached, out, range);
+  }
+#endif
+
+  // Client qui accepte le flux MODE Z tel quel : pas de regroupement, un
+  // meneur devrait décompresser pour ses suiveurs. Le cache SD désactive
+  // de toute façon ce relais compressé
+  bool passthrough = accept_deflate;
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  passthrough = passthrough && storage_ == nullptr;
+#endif
+
+  // Fichier complet déjà en cours de téléchargement : on se greffe dessus
+  std::shared_ptr<SharedTransfer> shared;
+  bool leader = false;
+  if (coalesce && !range.requested && coalesce_buffer_ > 0 && !passthrough) {
+    shared = coalesce_join(remote_path, leader);
+  }
+  if (shared != nullptr && !leader) {
+    out.set_source(SOURCE_SHARED);
+    SharedReader reader;
+    if (serve_follower(*shared, reader, out)) {
+      return true;
+    }
+    // Le meneur a échoué avant le premier octet. Il est déjà retiré des
+    // transferts en cours : le premier suiveur à revenir devient le nouveau
+    // meneur et les autres se greffent sur lui, plutôt que N téléchargements.
+    // Chaque tour retire au moins un meneur : la récursion reste bornée par
+    // le nombre de requêtes simultanées. Arrivé trop tard pour un meneur
+    // toujours actif : téléchargement autonome
+    if (!out.started()) {
+      bool leader_failed;
+      {
+        LockGuard lock(shared->mutex);
+        leader_failed = shared->state == SharedTransfer::FAILED;
+      }
+      return download_file(remote_path, out, range, accept_deflate, leader_failed);
+    }
+    return false;
+  }
+
+  out.set_source(SOURCE_FTP);
+  bool ok = fetch_from_ftp(remote_path, out, range, shared.get(), accept_deflate);
+  if (shared != nullptr) {
+    coalesce_finish(remote_path, *shared);
+  }
+  return ok;
+}
+
+FTPSession *FTPHTTPProxy::begin_transfer(const std::string &remote_path, RemoteFileInfo *info, int &data_sock,
+                                         TraceRecord *trace) {
+  FTPSession *session = nullptr;
+  bool reused = false;
+  data_sock = -1;
+
+  // Une connexion du pool peut avoir expiré côté serveur : dans ce cas on
+  // recommence une fois avec une connexion neuve, avant tout envoi au client
+  for (int attempt = 0; attempt < 2 && data_sock < 0; attempt++) {
+    session = acquire_session(reused);
+    if (session == nullptr) {
+      return nullptr;
+    }
+    session->trace = trace;
+    if (trace != nullptr) {
+      trace->upstream = session->upstream;
+    }
+
+    // SIZE, MDTM et PASV/EPSV partent ensemble : un seul aller-retour.
+    // Sans info (envoi STOR), seul le mode passif est demandé
+    std::string commands = info != nullptr ? stat_commands(remote_path) : std::string();
+    bool ok = send_commands(*session, commands + passive_command(*session)) &&
+              (info == nullptr || read_stat_replies(*session, *info));
+    data_sock = ok ? open_data_connection(*session) : -1;
+    if (data_sock < 0) {
+      release_session(session, false);
+      session = nullptr;
+      if (!reused) {
+        return nullptr;
+      }
+    }
+  }
+  if (session != nullptr && info != nullptr) {
+    meta_store(remote_path, *info);
+  }
+  return session;
+}
+
+bool FTPHTTPProxy::send_retr(FTPSession *session, const std::string &remote_path, size_t start, int data_sock,
+                             bool *compressed, bool *rest_refused) {
+  // Changement de mode (MODE Z / MODE S) et reprise côté FTP au premier
+  // octet demandé, envoyés avec RETR
+  bool want_z = compressed != nullptr && *compressed;
+  bool switch_mode = session->mode_z != want_z;
+  std::string commands;
+  if (switch_mode) {
+    commands = want_z ? "MODE Z\r\n" : "MODE S\r\n";
+  }
+  if (start > 0) {
+    commands += "REST " + std::to_string(start) + "\r\n";
+  }
+  commands += "RETR " + remote_path + "\r\n";
+  if (!send_commands(*session, commands)) {
+    sock_close(data_sock);
+    release_session(session, false);
+    return false;
+  }
+  if (switch_mode) {
+    bool accepted = read_reply(*session) / 100 == 2;
+    if (want_z) {
+      // Serveur sans MODE Z : RETR part en mode S, rien d'autre ne change
+      LockGuard lock(pool_mutex_);
+      upstreams_[session->upstream].mode_z = accepted ? 1 : 0;
+    } else if (!accepted) {
+      sock_close(data_sock);
+      release_session(session, false);
+      return false;
+    }
+    session->mode_z = want_z && accepted;
+    if (compressed != nullptr) {
+      *compressed = session->mode_z;
+    }
+  }
+  if (start > 0) {
+    int code = read_reply(*session);
+    if (code / 100 == 5 && rest_refused != nullptr) {
+      // REST refusé : le serveur exécute RETR depuis le début du fichier
+      *rest_refused = true;
+    } else if (code != 350) {
+      // RETR est déjà parti : la connexion de contrôle n'est plus dans un état sûr
+      sock_close(data_sock);
+      release_session(session, false);
+      return false;
+    }
+  }
+
+  // 125 ou 150 : le transfert commence
+  int code = read_reply(*session);
+  if (code / 100 != 1) {
+    sock_close(data_sock);
+    // 550 & co : la connexion de contrôle reste utilisable
+    release_session(session, code / 100 == 4 || code / 100 == 5);
+    return false;
+  }
+  if (!secure_data(*session, data_sock)) {
+    sock_close(data_sock);
+    release_session(session, false);
+    return false;
+  }
+  return true;
+}
+
+bool FTPHTTPProxy::end_transfer(FTPSession *session, bool relay_ok, bool truncated) {
+  // Vérification de la réponse finale 226. Un transfert interrompu laisse la
+  // connexion de contrôle dans un état incertain : elle n'est pas réutilisée
+  bool success = false;
+  if (relay_ok && !truncated) {
+    int code = read_reply(*session);
+    success = code == 226 || code == 250;
+  }
+  release_session(session, relay_ok && !truncated && success);
+  return success;
+}
+
+bool FTPHTTPProxy::fetch_from_ftp(const std::string &remote_path, ResponseStream &out, const ByteRange &range,
+                                  SharedTransfer *shared, bool accept_deflate) {
+  int data_sock;
+  RemoteFileInfo info;
+  size_t start = 0;
+  size_t remaining = SIZE_MAX;
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  CacheEntry cached;
+  bool have_cached = cache_lookup(remote_path, cached);
+#endif
+
+  uint32_t started = millis();
+  TraceRecord *trace = out.trace();
+  FTPSession *session = begin_transfer(remote_path, &info, data_sock, trace);
+  if (session == nullptr) {
+    return false;
+  }
+
+  // Phases de connexion rapportées une seule fois, par le premier transfert
+  TransferStats stats;
+  stats.setup = session->timings;
+  session->timings = ConnectTimings();
+  stats.control_ms = millis() - started;
+  stats.control_ms -= std::min(stats.control_ms, stats.setup.dns + stats.setup.connect + stats.setup.login);
+  metrics_.observe(PHASE_CONTROL, stats.control_ms);
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  // Copie SD toujours identique au fichier distant : servie depuis la carte
+  if (have_cached && info.has_size && info.size == cached.size && info.mtime == cached.mtime) {
+    sock_close(data_sock);
+    release_session(session, true);
+    cache_mark_validated(remote_path);
+    out.set_source(SOURCE_SD);
+    return serve_cached_file(remote_path, cached, out, range);
+  }
+#endif
+
+  // MODE Z pour les fichiers complets seulement : la sémantique de REST sur un
+  // flux compressé varie selon les serveurs. Le flux deflate est transmis tel
+  // quel au client qui l'accepte, sauf s'il alimente des suiveurs ou le cache
+  bool compressed = mode_z_ && !range.requested && upstream_mode_z(*session) != 0;
+  bool passthrough = compressed && accept_deflate && shared == nullptr;
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  passthrough = passthrough && storage_ == nullptr;
+#endif
+
+  if (!passthrough && !apply_file_info(info, range, out, start, remaining)) {
+    sock_close(data_sock);
+    release_session(session, true);
+    return out.finish();
+  }
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  // Gros fichier complet : plusieurs connexions en parallèle vers la carte.
+  // Toutes sont ouvertes avant les en-têtes, sinon un seul flux
+  std::vector<Segment> segments;
+  std::string segment_tmp;
+  if (segments_ > 1 && storage_ != nullptr && !range.requested && info.has_size && info.size >= segment_min_size_ &&
+      open_segments(remote_path, info, session, data_sock, segments, segment_tmp)) {
+    out.set_source(SOURCE_SEGMENTED);
+    bool ok = fetch_segmented(remote_path, info, segments, segment_tmp, out, shared, stats);
+    report_transfer(remote_path, stats, trace, ok);
+    return ok && out.finish();
+  }
+#endif
+
+  // Décompression locale : sans mémoire pour la fenêtre, transfert en mode S
+  Inflater inflater;
+  if (compressed && !passthrough && !inflater.init()) {
+    ESP_LOGW(TAG, "Mémoire insuffisante pour MODE Z, transfert non compressé");
+    compressed = false;
+  }
+  stats.retr_sent = millis();
+  bool rest_refused = false;
+  if (!send_retr(session, remote_path, start, data_sock, &compressed, &rest_refused)) {
+    return false;
+  }
+  if (rest_refused) {
+    // Serveur sans REST : le fichier complet arrive, servi en 200 plutôt
+    // qu'en erreur (RFC 9110 autorise à ignorer Range)
+    ESP_LOGW(TAG, "REST refusé pour %s, réponse complète", remote_path.c_str());
+    out.set_status("200 OK");
+    out.remove_header("Content-Range");
+    out.set_content_length(info.size);
+    start = 0;
+    remaining = SIZE_MAX;
+  }
+  if (passthrough && compressed) {
+    // Taille compressée inconnue : réponse en chunked
+    add_validators(info, out, true);
+    out.add_header("Content-Encoding", "deflate");
+  } else if (passthrough) {
+    // MODE Z refusé : réponse ordinaire (fichier complet, jamais de 416)
+    passthrough = false;
+    apply_file_info(info, range, out, start, remaining);
+  }
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  // Un fichier complet de taille connue est écrit sur la carte au passage
+  FILE *cache_file = nullptr;
+  std::string cache_tmp;
+  if (storage_ != nullptr && !range.requested && info.has_size) {
+    cache_tmp = cache_temp_acquire(remote_path);
+    cache_file = storage_->open_file_direct(cache_tmp, "wb");
+  }
+  size_t cache_written = 0;
+#endif
+
+  // Les suiveurs peuvent commencer leur réponse
+  if (shared != nullptr && !coalesce_start(*shared, info)) {
+    shared = nullptr;
+  }
+
+  // Content-Length annoncé d'après SIZE : le corps n'en dépasse jamais la
+  // longueur, et un fichier modifié depuis SIZE fait échouer la réponse
+  bool length_known = info.has_size && !passthrough;
+  size_t body_left = !length_known ? 0 : remaining != SIZE_MAX ? remaining : info.size - start;
+  bool overrun = false;
+
+  // Transfert en streaming, arrêté à la fin de la plage demandée. Si le
+  // client du meneur décroche, le relais continue pour les suiveurs
+  bool client_ok = true;
+  size_t offset = start;  // prochain octet attendu du serveur
+  auto sink = [&](const char *data, size_t len) {
+    if (length_known && len > body_left) {
+      overrun = true;
+      len = body_left;
+      if (len == 0) {
+        return false;
+      }
+    }
+    if (length_known) {
+      body_left -= len;
+    }
+    if (!stats.first_byte) {
+      stats.first_byte = true;
+      stats.first_byte_at = millis();
+    }
+    offset += len;
+    if (shared != nullptr) {
+      coalesce_write(*shared, data, len);
+    }
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+    if (cache_file != nullptr) {
+      if (fwrite(data, 1, len, cache_file) != len) {
+        ESP_LOGW(TAG, "Échec d'écriture dans le cache, abandon du cache pour %s", remote_path.c_str());
+        fclose(cache_file);
+        cache_file = nullptr;
+        storage_->delete_file_direct(cache_tmp);
+      } else {
+        cache_written += len;
+      }
+    }
+#endif
+    uint32_t write_started = millis();
+    if (client_ok && !out.write(data, len)) {
+      ESP_LOGE(TAG, "Échec d'envoi au client");
+      client_ok = false;
+    }
+    stats.client_ms += millis() - write_started;
+    return !overrun && (client_ok || (shared != nullptr && coalesce_has_readers(*shared)));
+  };
+
+  RelaySink deliver = sink;
+  bool inflating = compressed && !passthrough;
+  RelaySink inflate = [&](const char *data, size_t len) { return inflater.feed(data, len, deliver); };
+
+  bool relay_ok, truncated, success;
+  for (uint8_t retry = 0;; retry++) {
+    relay_ok = relay_data(data_sock, remaining, inflating ? inflate : deliver);
+    sock_close(data_sock);
+
+    // Plage servie avant l'EOF : le serveur va répondre 426 puis éventuellement
+    // 226, on ne réutilise donc pas cette connexion de contrôle
+    truncated = remaining == 0;
+    success = end_transfer(session, relay_ok, truncated) && (!inflating || inflater.finished());
+    // Pas de reprise d'un flux compressé : l'état du décompresseur est perdu
+    if (success || truncated || !relay_ok || !info.has_size || compressed || retry >= max_retries_) {
+      break;
+    }
+
+    // Canal de données coupé en cours de route : reprise à l'octet suivant
+    // pour que le client reçoive un flux continu
+    ESP_LOGW(TAG, "Transfert de %s interrompu à %u octets, reprise %u/%u", remote_path.c_str(), (unsigned) offset,
+             retry + 1, max_retries_);
+    vTaskDelay(pdMS_TO_TICKS(retry_backoff_ << retry));
+    RemoteFileInfo current;
+    if (trace != nullptr) {
+      trace->retries = retry + 1;
+    }
+    session = begin_transfer(remote_path, &current, data_sock, trace);
+    if (session == nullptr) {
+      break;
+    }
+    if (!current.has_size || current.size != info.size || current.mtime != info.mtime) {
+      ESP_LOGW(TAG, "%s modifié pendant le transfert, abandon", remote_path.c_str());
+      sock_close(data_sock);
+      release_session(session, true);
+      break;
+    }
+    if (!send_retr(session, remote_path, offset, data_sock)) {
+      break;
+    }
+  }
+  bool mismatch = overrun || (length_known && body_left > 0 && success);
+  if (mismatch) {
+    ESP_LOGW(TAG, "%s modifié entre SIZE et RETR : %s que annoncé", remote_path.c_str(),
+             overrun ? "plus long" : "plus court");
+    success = false;
+  }
+  if (shared != nullptr && relay_ok && success) {
+    coalesce_complete(*shared);
+  }
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  if (cache_file != nullptr) {
+    fclose(cache_file);
+    if (relay_ok && success && cache_written == info.size) {
+      cache_store(remote_path, info, cache_tmp);
+    } else {
+      storage_->delete_file_direct(cache_tmp);
+    }
+  }
+  if (!cache_tmp.empty()) {
+    cache_temp_release(cache_tmp);
+  }
+#endif
+
+  // Bilan du transfert : les octets comptés sont ceux reçus du serveur
+  bool ok = client_ok && (success || truncated) && !mismatch;
+  stats.bytes = offset - start;
+  report_transfer(remote_path, stats, trace, ok);
+
+  // Fin de réponse (chunk final en mode chunked)
+  if (!ok) {
+    return false;
+  }
+  return out.finish();
+}
+
+void FTPHTTPProxy::report_transfer(const std::string &remote_path, const TransferStats &stats, TraceRecord *trace,
+                                   bool ok) {
+  uint32_t first_byte_ms = stats.first_byte ? stats.first_byte_at - stats.retr_sent : 0;
+  uint32_t transfer_ms = stats.first_byte ? millis() - stats.first_byte_at : 0;
+  if (stats.first_byte) {
+    metrics_.observe(PHASE_FIRST_BYTE, first_byte_ms);
+    metrics_.observe(PHASE_TRANSFER, transfer_ms);
+    metrics_.observe(PHASE_CLIENT, stats.client_ms);
+  }
+  metrics_.record_transfer(stats.bytes, transfer_ms, ok);
+  if (trace != nullptr) {
+    trace->phases[PHASE_DNS] = stats.setup.dns;
+    trace->phases[PHASE_CONNECT] = stats.setup.connect;
+    trace->phases[PHASE_LOGIN] = stats.setup.login;
+    trace->phases[PHASE_CONTROL] = stats.control_ms;
+    trace->phases[PHASE_FIRST_BYTE] = first_byte_ms;
+    trace->phases[PHASE_TRANSFER] = transfer_ms;
+    trace->phases[PHASE_CLIENT] = stats.client_ms;
+  }
+  ESP_LOGD(TAG, "%s : dns %u ms, connexion %u ms, login %u ms, contrôle %u ms, premier octet %u ms, "
+                "transfert %u ms (client %u ms), %u octets",
+           remote_path.c_str(), (unsigned) stats.setup.dns, (unsigned) stats.setup.connect,
+           (unsigned) stats.setup.login, (unsigned) stats.control_ms, (unsigned) first_byte_ms, (unsigned) transfer_ms,
+           (unsigned) stats.client_ms, (unsigned) stats.bytes);
+}
+
+bool FTPHTTPProxy::upload_file(const std::string &remote_path, httpd_req_t *req) {
+  int data_sock;
+  FTPSession *session = begin_transfer(remote_path, nullptr, data_sock);
+  if (session == nullptr) {
+    return false;
+  }
+
+  // Envoi sous un nom temporaire, renommé seulement une fois le corps complet :
+  // un envoi interrompu ne remplace jamais le fichier existant.
+  // Connexion laissée en MODE Z par un téléchargement : retour au mode S
+  std::string temp_path = remote_path + ".part";
+  std::string commands = session->mode_z ? "MODE S\r\nSTOR " : "STOR ";
+  if (!send_commands(*session, commands + temp_path + "\r\n") ||
+      (session->mode_z && read_reply(*session) / 100 != 2)) {
+    sock_close(data_sock);
+    release_session(session, false);
+    return false;
+  }
+  session->mode_z = false;
+  int code = read_reply(*session);
+  if (code / 100 != 1) {
+    sock_close(data_sock);
+    // 553 (nom refusé), 550 (droits) : la connexion de contrôle reste utilisable
+    release_session(session, code / 100 == 4 || code / 100 == 5);
+    ESP_LOGW(TAG, "STOR refusé pour %s (%d)", remote_path.c_str(), code);
+    return false;
+  }
+  if (!secure_data(*session, data_sock)) {
+    sock_close(data_sock);
+    release_session(session, false);
+    return false;
+  }
+
+  // Le corps est relayé bloc par bloc : jamais plus d'upload_chunk_size en RAM
+  std::vector<char> buffer(upload_chunk_size_);
+  size_t remaining = req->content_len;
+  int timeouts = 0;
+  bool ok = true;
+  while (ok && remaining > 0) {
+    int n = httpd_req_recv(req, buffer.data(), std::min(buffer.size(), remaining));
+    if (n == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < 3) {
+      continue;
+    }
+    if (n <= 0) {
+      ESP_LOGE(TAG, "Corps de requête interrompu (%u octets restants)", (unsigned) remaining);
+      ok = false;
+      break;
+    }
+    timeouts = 0;
+    remaining -= n;
+    for (int sent = 0; ok && sent < n;) {
+      int s = sock_send(data_sock, buffer.data() + sent, n - sent);
+      ok = s > 0;
+      sent += s;
+    }
+  }
+
+  if (!ok) {
+    // Canal de données coupé par RST puis ABOR (426 puis 226, ou 225/226 seul) ;
+    // le fichier temporaire éventuellement conservé par le serveur est supprimé
+    sock_abort(data_sock);
+    code = ftp_command(*session, "ABOR");
+    if (code == 426 || code == 451) {
+      code = read_reply(*session);
+    }
+    bool reusable = code / 100 == 2 && ftp_command(*session, "DELE " + temp_path) != 0;
+    release_session(session, reusable);
+    return false;
+  }
+
+  // La fermeture du canal de données marque la fin du fichier pour le serveur
+  sock_close(data_sock);
+  bool success = end_transfer(session, true, false);
+  if (success) {
+    success = rename_remote(temp_path, remote_path);
+  }
+
+  // Les copies locales ne correspondent plus au fichier distant
+  invalidate_path(remote_path);
+  if (success) {
+    ESP_LOGI(TAG, "Fichier envoyé : %s (%u octets)", remote_path.c_str(), (unsigned) req->content_len);
+  }
+  return success;
+}
+
+bool FTPHTTPProxy::rename_remote(const std::string &from, const std::string &to) {
+  bool reused;
+  FTPSession *session = acquire_session(reused);
+  if (session == nullptr) {
+    return false;
+  }
+  // Certains serveurs refusent RNTO sur un fichier existant : il est alors
+  // supprimé puis le renommage retenté
+  int code = 0;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    code = ftp_command(*session, "RNFR " + from);
+    if (code == 350) {
+      code = ftp_command(*session, "RNTO " + to);
+    }
+    if (code / 100 == 2 || attempt > 0 || code / 100 != 5 || ftp_command(*session, "DELE " + to) / 100 != 2) {
+      break;
+    }
+  }
+  if (code / 100 != 2) {
+    ESP_LOGW(TAG, "Renommage de %s en %s refusé (%d)", from.c_str(), to.c_str(), code);
+    ftp_command(*session, "DELE " + from);
+  }
+  release_session(session, code != 0);
+  return code / 100 == 2;
+}
+
+void FTPHTTPProxy::invalidate_path(const std::string &remote_path) {
+  {
+    LockGuard lock(meta_mutex_);
+    meta_cache_.erase(remote_path);
+  }
+  {
+    size_t slash = remote_path.rfind('/');
+    LockGuard lock(listing_mutex_);
+    listings_.erase(slash == std::string::npos ? std::string() : remote_path.substr(0, slash));
+  }
+  ram_erase(remote_path);
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  if (storage_ != nullptr) {
+    // Sans .meta, l'entrée est ignorée au prochain démarrage
+    storage_->delete_file_direct(cache_file_path(remote_path, ".meta"));
+    LockGuard lock(cache_mutex_);
+    cache_index_.erase(remote_path);
+  }
+#endif
+}
+
+std::shared_ptr<RamFile> FTPHTTPProxy::ram_lookup(const std::string &remote_path) {
+  std::shared_ptr<RamFile> file;
+  {
+    LockGuard lock(ram_mutex_);
+    auto it = ram_cache_.find(remote_path);
+    if (it == ram_cache_.end()) {
+      return nullptr;
+    }
+    file = it->second;
+    if (millis() - file->validated_at < refresh_interval_) {
+      return file;
+    }
+  }
+
+  // Revalidation en retard (serveur injoignable au dernier passage ?) :
+  // la copie n'est servie que si SIZE/MDTM n'ont pas changé
+  RemoteFileInfo info;
+  if (!get_file_info(remote_path, info) || !info.has_size || info.size != file->info.size ||
+      info.mtime != file->info.mtime) {
+    return nullptr;
+  }
+  ram_mark_validated(remote_path);
+  return file;
+}
+
+void FTPHTTPProxy::ram_mark_validated(const std::string &remote_path) {
+  LockGuard lock(ram_mutex_);
+  auto it = ram_cache_.find(remote_path);
+  if (it != ram_cache_.end()) {
+    it->second->validated_at = millis();
+  }
+}
+
+void FTPHTTPProxy::ram_store(const std::string &remote_path, std::shared_ptr<RamFile> file) {
+  LockGuard lock(ram_mutex_);
+  file->validated_at = millis();
+  auto &slot = ram_cache_[remote_path];
+  if (slot != nullptr) {
+    ram_used_ -= slot->info.size;
+  }
+  ram_used_ += file->info.size;
+  slot = std::move(file);
+}
+
+void FTPHTTPProxy::ram_erase(const std::string &remote_path) {
+  LockGuard lock(ram_mutex_);
+  auto it = ram_cache_.find(remote_path);
+  if (it != ram_cache_.end()) {
+    ram_used_ -= it->second->info.size;
+    ram_cache_.erase(it);
+  }
+}
+
+bool FTPHTTPProxy::ram_has_room(const std::string &remote_path, size_t size) {
+  if (size > prefetch_ram_limit_) {
+    return false;
+  }
+  // La version actuelle du fichier sera remplacée : sa place compte comme libre
+  LockGuard lock(ram_mutex_);
+  auto it = ram_cache_.find(remote_path);
+  size_t used = ram_used_ - (it != ram_cache_.end() ? it->second->info.size : 0);
+  return used + size <= prefetch_ram_budget_;
+}
+
+bool FTPHTTPProxy::serve_ram_file(const RamFile &file, ResponseStream &out, const ByteRange &range) {
+  size_t start, remaining;
+  if (!apply_file_info(file.info, range, out, start, remaining)) {
+    return out.finish();
+  }
+  size_t len = std::min(remaining, file.info.size - start);
+  return out.write(file.data + start, len) && out.finish();
+}
+
+void FTPHTTPProxy::prefetch_task(void *arg) {
+  auto *proxy = static_cast<FTPHTTPProxy *>(arg);
+
+  // Les règles génériques (firmware/*.bin) ne désignent pas de fichier précis
+  // et ne sont pas préchargées
+  bool all_ok = true;
+  for (const auto &remote_path : proxy->remote_paths_) {
+    if (!proxy->prefetch_path(remote_path)) {
+      ESP_LOGW(TAG, "Échec du préchargement de %s", remote_path.c_str());
+      all_ok = false;
+    }
+  }
+
+  // Après un échec (Wi-Fi pas encore connecté, serveur absent...), nouvel essai plus tôt
+  uint32_t next_in = all_ok ? proxy->refresh_interval_ : std::min<uint32_t>(proxy->refresh_interval_, 30000);
+  proxy->prefetch_next_ = millis() + next_in;
+  proxy->prefetch_running_ = false;
+  vTaskDelete(nullptr);
+}
+
+bool FTPHTTPProxy::prefetch_path(const std::string &remote_path) {
+  int data_sock;
+  RemoteFileInfo info;
+  FTPSession *session = begin_transfer(remote_path, &info, data_sock);
+  if (session == nullptr) {
+    return false;
+  }
+
+  // Copie en RAM ou sur la carte toujours à jour : simple revalidation
+  bool unchanged = false;
+  {
+    LockGuard lock(ram_mutex_);
+    auto it = ram_cache_.find(remote_path);
+    if (it != ram_cache_.end() && info.has_size && info.size == it->second->info.size &&
+        info.mtime == it->second->info.mtime) {
+      it->second->validated_at = millis();
+      unchanged = true;
+    }
+  }
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  CacheEntry cached;
+  if (!unchanged && cache_lookup(remote_path, cached) && info.has_size && info.size == cached.size &&
+      info.mtime == cached.mtime) {
+    cache_mark_validated(remote_path);
+    unchanged = true;
+  }
+#endif
+  if (unchanged) {
+    sock_close(data_sock);
+    release_session(session, true);
+    return true;
+  }
+
+  // Sans taille connue, impossible de choisir la destination ni de vérifier la copie
+  bool to_ram = info.has_size && ram_has_room(remote_path, info.size);
+  bool to_sd = false;
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  to_sd = !to_ram && info.has_size && storage_ != nullptr;
+#endif
+  if (!to_ram && !to_sd) {
+    sock_close(data_sock);
+    release_session(session, true);
+    ram_erase(remote_path);
+    ESP_LOGD(TAG, "%s non préchargé (taille inconnue ou cache plein)", remote_path.c_str());
+    return true;
+  }
+
+  auto file = std::make_shared<RamFile>();
+  file->info = info;
+  if (to_ram) {
+    // Un octet de plus pour détecter un fichier qui grossit pendant le transfert
+    file->data = (char *) heap_caps_malloc(info.size + 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (file->data == nullptr) {
+      file->data = (char *) heap_caps_malloc(info.size + 1, MALLOC_CAP_8BIT);
+    }
+    if (file->data == nullptr) {
+      sock_close(data_sock);
+      release_session(session, true);
+      ESP_LOGW(TAG, "Mémoire insuffisante pour précharger %s", remote_path.c_str());
+      return false;
+    }
+  }
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  FILE *cache_file = nullptr;
+  std::string cache_tmp;
+  if (to_sd) {
+    cache_tmp = cache_temp_acquire(remote_path);
+    cache_file = storage_->open_file_direct(cache_tmp, "wb");
+    if (cache_file == nullptr) {
+      cache_temp_release(cache_tmp);
+      sock_close(data_sock);
+      release_session(session, true);
+      return false;
+    }
+  }
+#endif
+
+  if (!send_retr(session, remote_path, 0, data_sock)) {
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+    if (cache_file != nullptr) {
+      fclose(cache_file);
+      storage_->delete_file_direct(cache_tmp);
+      cache_temp_release(cache_tmp);
+    }
+#endif
+    return false;
+  }
+
+  size_t written = 0;
+  size_t remaining = SIZE_MAX;
+  bool relay_ok = relay_data(data_sock, remaining, [&](const char *data, size_t len) {
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+    if (cache_file != nullptr) {
+      written += len;
+      return fwrite(data, 1, len, cache_file) == len;
+    }
+#endif
+    if (written + len > info.size + 1) {
+      return false;
+    }
+    memcpy(file->data + written, data, len);
+    written += len;
+    return true;
+  });
+  sock_close(data_sock);
+  bool ok = end_transfer(session, relay_ok, false) && written == info.size;
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  if (cache_file != nullptr) {
+    fclose(cache_file);
+    if (ok) {
+      cache_store(remote_path, info, cache_tmp);
+      // Fichier devenu trop gros pour la RAM : l'ancienne copie ne sert plus
+      ram_erase(remote_path);
+    } else {
+      storage_->delete_file_direct(cache_tmp);
+    }
+    cache_temp_release(cache_tmp);
+    return ok;
+  }
+#endif
+  if (ok) {
+    ram_store(remote_path, std::move(file));
+    ESP_LOGD(TAG, "Fichier préchargé en RAM : %s (%u octets)", remote_path.c_str(), (unsigned) info.size);
+  }
+  return ok;
+}
+
+std::shared_ptr<SharedTransfer> FTPHTTPProxy::coalesce_join(const std::string &remote_path, bool &leader) {
+  LockGuard lock(inflight_mutex_);
+  auto it = inflight_.find(remote_path);
+  if (it != inflight_.end()) {
+    leader = false;
+    return it->second;
+  }
+
+  auto shared = std::make_shared<SharedTransfer>();
+  inflight_[remote_path] = shared;
+  leader = true;
+  return shared;
+}
+
+bool FTPHTTPProxy::coalesce_start(SharedTransfer &shared, const RemoteFileInfo &info) {
+  // Capacité minimale de deux blocs pour que le meneur ne bloque pas à chaque écriture
+  size_t capacity = std::max(coalesce_buffer_, 2 * chunk_size_);
+  char *ring = (char *) heap_caps_malloc(capacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (ring == nullptr) {
+    ring = (char *) heap_caps_malloc(capacity, MALLOC_CAP_8BIT);
+  }
+
+  LockGuard lock(shared.mutex);
+  if (ring == nullptr) {
+    ESP_LOGW(TAG, "Tampon de partage indisponible, pas de regroupement");
+    shared.state = SharedTransfer::FAILED;
+    return false;
+  }
+  shared.ring = ring;
+  shared.capacity = capacity;
+  shared.info = info;
+  shared.state = SharedTransfer::STREAMING;
+  return true;
+}
+
+void FTPHTTPProxy::coalesce_write(SharedTransfer &shared, const char *data, size_t len) {
+  uint32_t wait_start = millis();
+  while (true) {
+    {
+      LockGuard lock(shared.mutex);
+      size_t min_pos = shared.produced;
+      for (auto *reader : shared.readers) {
+        if (!reader->evicted) {
+          min_pos = std::min(min_pos, reader->pos);
+        }
+      }
+
+      if (shared.produced + len - min_pos <= shared.capacity) {
+        size_t offset = shared.produced % shared.capacity;
+        size_t first = std::min(len, shared.capacity - offset);
+        memcpy(shared.ring + offset, data, first);
+        memcpy(shared.ring, data + first, len - first);
+        shared.produced += len;
+        return;
+      }
+
+      // Un client bloqué ne doit pas figer les autres indéfiniment
+      if (millis() - wait_start > 10000) {
+        for (auto *reader : shared.readers) {
+          if (reader->pos == min_pos) {
+            ESP_LOGW(TAG, "Client trop lent, détaché du transfert partagé");
+            reader->evicted = true;
+          }
+        }
+        continue;
+      }
+    }
+    vTaskDelay(pdMS_TO_TICKS(5));
+  }
+}
+
+bool FTPHTTPProxy::coalesce_has_readers(SharedTransfer &shared) {
+  LockGuard lock(shared.mutex);
+  return !shared.readers.empty();
+}
+
+void FTPHTTPProxy::coalesce_complete(SharedTransfer &shared) {
+  LockGuard lock(shared.mutex);
+  shared.state = SharedTransfer::DONE;
+}
+
+void FTPHTTPProxy::coalesce_finish(const std::string &remote_path, SharedTransfer &shared) {
+  {
+    LockGuard lock(inflight_mutex_);
+    inflight_.erase(remote_path);
+  }
+  // Sans coalesce_complete(), les suiveurs doivent se débrouiller seuls
+  LockGuard lock(shared.mutex);
+  if (shared.state != SharedTransfer::DONE) {
+    shared.state = SharedTransfer::FAILED;
+  }
+}
+
+bool FTPHTTPProxy::serve_follower(SharedTransfer &shared, SharedReader &reader, ResponseStream &out) {
+  {
+    // Les octets déjà écrasés dans l'anneau ne sont plus disponibles
+    LockGuard lock(shared.mutex);
+    if (shared.produced > shared.capacity && shared.state != SharedTransfer::STARTING) {
+      return false;
+    }
+    shared.readers.push_back(&reader);
+  }
+
+  bool ok = false;
+  bool started = false;
+  std::vector<char> buffer(chunk_size_);
+  while (true) {
+    SharedTransfer::State state;
+    size_t available;
+    {
+      LockGuard lock(shared.mutex);
+      state = shared.state;
+      available = shared.produced - reader.pos;
+      if (reader.evicted) {
+        break;
+      }
+    }
+
+    if (!started && state != SharedTransfer::STARTING) {
+      if (state == SharedTransfer::FAILED) {
+        break;
+      }
+      size_t start, remaining;
+      apply_file_info(shared.info, ByteRange(), out, start, remaining);
+      started = true;
+    }
+
+    if (available > 0) {
+      // Copie sous verrou : un lecteur détaché par le meneur peut voir ses
+      // octets écrasés à tout moment, l'envoi au client se fait ensuite
+      size_t len;
+      {
+        LockGuard lock(shared.mutex);
+        if (reader.evicted) {
+          break;
+        }
+        size_t offset = reader.pos % shared.capacity;
+        len = std::min({available, chunk_size_, shared.capacity - offset});
+        memcpy(buffer.data(), shared.ring + offset, len);
+        reader.pos += len;
+      }
+      if (!out.write(buffer.data(), len)) {
+        break;
+      }
+    } else if (state == SharedTransfer::DONE) {
+      ok = out.finish();
+      break;
+    } else if (state == SharedTransfer::FAILED) {
+      break;
+    } else {
+      vTaskDelay(pdMS_TO_TICKS(5));
+    }
+  }
+
+  LockGuard lock(shared.mutex);
+  shared.readers.erase(std::find(shared.readers.begin(), shared.readers.end(), &reader));
+  return ok;
+}
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+std::string FTPHTTPProxy::cache_file_path(const std::string &remote_path, const char *suffix) {
+  char name[16];
+  snprintf(name, sizeof(name), "/%08x", (unsigned) fnv1_hash(remote_path));
+  return cache_dir_ + name + suffix;
+}
+
+bool FTPHTTPProxy::cache_lookup(const std::string &remote_path, CacheEntry &entry) {
+  if (storage_ == nullptr) {
+    return false;
+  }
+  {
+    LockGuard lock(cache_mutex_);
+    auto it = cache_index_.find(remote_path);
+    if (it != cache_index_.end()) {
+      entry = it->second;
+      return true;
+    }
+  }
+
+  // Entrée laissée par un démarrage précédent : "taille mtime\nchemin"
+  std::string meta_path = cache_file_path(remote_path, ".meta");
+  if (!storage_->file_exists_direct(meta_path)) {
+    return false;
+  }
+  std::vector<uint8_t> meta = storage_->read_file_direct(meta_path);
+  std::string text(meta.begin(), meta.end());
+  unsigned long size;
+  long long mtime;
+  int consumed = 0;
+  if (sscanf(text.c_str(), "%lu %lld\n%n", &size, &mtime, &consumed) != 2 || text.substr(consumed) != remote_path ||
+      storage_->get_file_size(cache_file_path(remote_path, ".dat")) != size) {
+    // Collision de hachage ou entrée incomplète
+    return false;
+  }
+
+  entry.size = size;
+  entry.mtime = (time_t) mtime;
+  entry.validated = false;
+  LockGuard lock(cache_mutex_);
+  cache_index_[remote_path] = entry;
+  return true;
+}
+
+void FTPHTTPProxy::cache_mark_validated(const std::string &remote_path) {
+  LockGuard lock(cache_mutex_);
+  auto it = cache_index_.find(remote_path);
+  if (it != cache_index_.end()) {
+    it->second.validated = true;
+    it->second.validated_at = millis();
+  }
+}
+
+std::string FTPHTTPProxy::cache_temp_acquire(const std::string &remote_path) {
+  // "<hash>.<n>.tmp" : premier numéro libre pour ce chemin. Un fichier laissé
+  // par une coupure est écrasé par le prochain écrivain du même numéro
+  LockGuard lock(cache_mutex_);
+  char suffix[16];
+  for (unsigned n = 0;; n++) {
+    snprintf(suffix, sizeof(suffix), ".%u.tmp", n);
+    std::string tmp_path = cache_file_path(remote_path, suffix);
+    if (cache_writers_.insert(tmp_path).second) {
+      return tmp_path;
+    }
+  }
+}
+
+void FTPHTTPProxy::cache_temp_release(const std::string &tmp_path) {
+  LockGuard lock(cache_mutex_);
+  cache_writers_.erase(tmp_path);
+}
+
+void FTPHTTPProxy::cache_store(const std::string &remote_path, const RemoteFileInfo &info,
+                               const std::string &tmp_path) {
+  char header[48];
+  snprintf(header, sizeof(header), "%lu %lld\n", (unsigned long) info.size, (long long) info.mtime);
+  std::string text = header + remote_path;
+
+  // Les métadonnées sont écrites après le fichier : une coupure entre les deux
+  // laisse une entrée sans .meta, donc ignorée
+  std::string meta_path = cache_file_path(remote_path, ".meta");
+  storage_->delete_file_direct(meta_path);
+  if (!storage_->rename_file_direct(tmp_path, cache_file_path(remote_path, ".dat")) ||
+      !storage_->write_file_direct(meta_path, std::vector<uint8_t>(text.begin(), text.end()))) {
+    LockGuard lock(cache_mutex_);
+    cache_index_.erase(remote_path);
+    return;
+  }
+
+  CacheEntry entry;
+  entry.size = info.size;
+  entry.mtime = info.mtime;
+  entry.validated = true;
+  entry.validated_at = millis();
+  LockGuard lock(cache_mutex_);
+  cache_index_[remote_path] = entry;
+  ESP_LOGD(TAG, "Fichier mis en cache : %s (%u octets)", remote_path.c_str(), (unsigned) info.size);
+}
 
-bool FTPHTTPProxy::connect_to_ftp() {
-  struct hostent *ftp_host = gethostbyname(ftp_server_.c_str());
-  if (!ftp_host) {
-    ESP_LOGE(TAG, "Échec de la résolution DNS");
+bool FTPHTTPProxy::serve_cached_file(const std::string &remote_path, const CacheEntry &entry, ResponseStream &out,
+                                     const ByteRange &range) {
+  FILE *file = storage_->open_file_direct(cache_file_path(remote_path, ".dat"), "rb");
+  if (file == nullptr) {
+    LockGuard lock(cache_mutex_);
+    cache_index_.erase(remote_path);
     return false;
   }
 
-  sock_ = ::socket(AF_INET, SOCK_STREAM, 0);
-  if (sock_ < 0) {
-    ESP_LOGE(TAG, "Échec de création du socket : %d", errno);
+  RemoteFileInfo info;
+  info.has_size = true;
+  info.size = entry.size;
+  info.mtime = entry.mtime;
+  size_t start, remaining;
+  if (!apply_file_info(info, range, out, start, remaining) || fseek(file, start, SEEK_SET) != 0) {
+    fclose(file);
+    return out.finish();
+  }
+
+  std::vector<char> buffer(chunk_size_);
+  bool ok = true;
+  while (ok && remaining > 0) {
+    size_t n = fread(buffer.data(), 1, std::min(buffer.size(), remaining), file);
+    if (n == 0) {
+      break;
+    }
+    ok = out.write(buffer.data(), n);
+    if (remaining != SIZE_MAX) {
+      remaining -= n;
+    }
+  }
+  fclose(file);
+  return ok && out.finish();
+}
+
+bool FTPHTTPProxy::open_segments(const std::string &remote_path, const RemoteFileInfo &info, FTPSession *session,
+                                 int data_sock, std::vector<Segment> &segments, std::string &tmp_path) {
+  // Segments alignés sur 4 Kio : aucun secteur de la carte n'est partagé
+  // entre deux écrivains. Au-delà de la taille du pool, les segments
+  // attendraient une connexion libre
+  size_t count = std::min(segments_, pool_size_);
+  size_t length = ((info.size + count - 1) / count + 4095) & ~(size_t) 4095;
+  tmp_path = cache_temp_acquire(remote_path);
+  for (size_t offset = 0; offset < info.size; offset += length) {
+    Segment segment;
+    segment.proxy = this;
+    segment.remote_path = &remote_path;
+    segment.tmp_path = &tmp_path;
+    segment.info = info;
+    segment.offset = offset;
+    segment.length = std::min(length, info.size - offset);
+    segments.push_back(segment);
+  }
+  // La connexion ouverte par fetch_from_ftp sert au premier segment. Les
+  // autres sont ouvertes maintenant : une connexion manquante une fois les
+  // en-têtes envoyés laisserait au client un corps tronqué
+  segments[0].session = session;
+  segments[0].data_sock = data_sock;
+  bool ok = storage_->preallocate_file_direct(tmp_path, info.size);
+  for (size_t i = 1; ok && i < segments.size(); i++) {
+    RemoteFileInfo current;
+    segments[i].session = begin_transfer(remote_path, &current, segments[i].data_sock);
+    ok = segments[i].session != nullptr;
+    if (ok && (!current.has_size || current.size != info.size || current.mtime != info.mtime)) {
+      sock_close(segments[i].data_sock);
+      release_session(segments[i].session, true);
+      segments[i].session = nullptr;
+      ok = false;
+    }
+  }
+  if (ok) {
+    return true;
+  }
+
+  // Repli sur un seul flux : la connexion du premier segment est conservée
+  ESP_LOGW(TAG, "Connexions indisponibles pour %s, téléchargement en un seul flux", remote_path.c_str());
+  for (size_t i = 1; i < segments.size(); i++) {
+    if (segments[i].session != nullptr) {
+      sock_close(segments[i].data_sock);
+      release_session(segments[i].session, true);
+    }
+  }
+  segments.clear();
+  storage_->delete_file_direct(tmp_path);
+  cache_temp_release(tmp_path);
+  return false;
+}
+
+bool FTPHTTPProxy::fetch_segmented(const std::string &remote_path, const RemoteFileInfo &info,
+                                   std::vector<Segment> &segments, const std::string &tmp_path,
+                                   ResponseStream &out, SharedTransfer *shared, TransferStats &stats) {
+  stats.retr_sent = millis();
+  for (auto &segment : segments) {
+    segment.done = xSemaphoreCreateBinary();
+    if (segment.done != nullptr &&
+        xTaskCreate(segment_task, "ftp_segment", 4096 + TLS_STACK_EXTRA, &segment, uxTaskPriorityGet(nullptr),
+                    nullptr) != pdPASS) {
+      vSemaphoreDelete(segment.done);
+      segment.done = nullptr;
+    }
+  }
+  ESP_LOGD(TAG, "Téléchargement de %s en %u segments", remote_path.c_str(), (unsigned) segments.size());
+
+  if (shared != nullptr && !coalesce_start(*shared, info)) {
+    shared = nullptr;
+  }
+
+  // Chaque segment est envoyé au client dès qu'il est complet, dans l'ordre.
+  // Un client parti n'interrompt pas les segments : la copie SD est terminée
+  bool client_ok = true;
+  bool all_ok = true;
+  std::vector<char> buffer(chunk_size_);
+  for (auto &segment : segments) {
+    if (segment.done == nullptr) {
+      // Tâche impossible à créer : segment téléchargé ici
+      segment.ok = download_segment(segment);
+    } else {
+      xSemaphoreTake(segment.done, portMAX_DELAY);
+      vSemaphoreDelete(segment.done);
+    }
+    all_ok = all_ok && segment.ok;
+    // Premier octet : premier segment complet, prêt à partir vers le client
+    if (all_ok && !stats.first_byte) {
+      stats.first_byte = true;
+      stats.first_byte_at = millis();
+    }
+    if (!all_ok || !(client_ok || (shared != nullptr && coalesce_has_readers(*shared)))) {
+      continue;
+    }
+
+    // Lecteur ouvert après la fermeture de l'écrivain pour voir ses données
+    FILE *file = storage_->open_file_direct(tmp_path, "rb");
+    bool read_ok = file != nullptr && fseek(file, segment.offset, SEEK_SET) == 0;
+    size_t remaining = segment.length;
+    while (read_ok && remaining > 0) {
+      size_t n = fread(buffer.data(), 1, std::min(buffer.size(), remaining), file);
+      read_ok = n > 0;
+      if (shared != nullptr && n > 0) {
+        coalesce_write(*shared, buffer.data(), n);
+      }
+      uint32_t write_started = millis();
+      if (client_ok && n > 0 && !out.write(buffer.data(), n)) {
+        ESP_LOGE(TAG, "Échec d'envoi au client");
+        client_ok = false;
+      }
+      stats.client_ms += millis() - write_started;
+      remaining -= n;
+    }
+    if (file != nullptr) {
+      fclose(file);
+    }
+    all_ok = all_ok && read_ok;
+    if (all_ok) {
+      stats.bytes += segment.length;
+    }
+  }
+
+  if (all_ok) {
+    cache_store(remote_path, info, tmp_path);
+    if (shared != nullptr) {
+      coalesce_complete(*shared);
+    }
+  } else {
+    storage_->delete_file_direct(tmp_path);
+  }
+  cache_temp_release(tmp_path);
+  return client_ok && all_ok;
+}
+
+void FTPHTTPProxy::segment_task(void *arg) {
+  auto *segment = static_cast<Segment *>(arg);
+  segment->ok = segment->proxy->download_segment(*segment);
+  xSemaphoreGive(segment->done);
+  vTaskDelete(nullptr);
+}
+
+bool FTPHTTPProxy::download_segment(Segment &segment) {
+  const std::string &remote_path = *segment.remote_path;
+  FTPSession *session = segment.session;
+  int data_sock = segment.data_sock;
+  FILE *file = storage_->open_file_direct(*segment.tmp_path, "r+b");
+  if (file == nullptr) {
+    if (session != nullptr) {
+      sock_close(data_sock);
+      release_session(session, true);
+    }
     return false;
   }
 
-  struct sockaddr_in server_addr;
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(21);
-  server_addr.sin_addr.s_addr = *((unsigned long *)ftp_host->h_addr);
+  // Comme fetch_from_ftp : reprise REST après une coupure, délai doublé
+  std::vector<char> buffer(chunk_size_);
+  size_t done = 0;
+  bool write_ok = true;
+  for (uint8_t retry = 0; write_ok && done < segment.length && retry <= max_retries_; retry++) {
+    if (session == nullptr) {
+      if (retry > 0) {
+        vTaskDelay(pdMS_TO_TICKS(retry_backoff_ << (retry - 1)));
+      }
+      RemoteFileInfo current;
+      session = begin_transfer(remote_path, &current, data_sock);
+      if (session == nullptr) {
+        continue;
+      }
+      if (!current.has_size || current.size != segment.info.size || current.mtime != segment.info.mtime) {
+        ESP_LOGW(TAG, "%s modifié pendant le transfert, abandon", remote_path.c_str());
+        sock_close(data_sock);
+        release_session(session, true);
+        break;
+      }
+    }
+    if (!send_retr(session, remote_path, segment.offset + done, data_sock)) {
+      session = nullptr;
+      continue;
+    }
+
+    size_t remaining = segment.length - done;
+    write_ok = fseek(file, segment.offset + done, SEEK_SET) == 0;
+    while (write_ok && remaining > 0) {
+      int n = sock_recv(data_sock, buffer.data(), std::min(buffer.size(), remaining));
+      if (n <= 0) {
+        break;
+      }
+      write_ok = fwrite(buffer.data(), 1, n, file) == (size_t) n;
+      done += n;
+      remaining -= n;
+    }
+    sock_close(data_sock);
+
+    // Segment lu avant l'EOF du fichier : la connexion n'est pas réutilisée,
+    // comme pour une plage dans fetch_from_ftp. La taille étant connue, seul
+    // le nombre d'octets reçus décide du succès du segment
+    bool truncated = remaining == 0 && segment.offset + segment.length < segment.info.size;
+    end_transfer(session, write_ok, truncated);
+    session = nullptr;
+  }
+
+  bool ok = fclose(file) == 0 && write_ok && done == segment.length;
+  if (!ok) {
+    ESP_LOGW(TAG, "Échec du segment %u-%u de %s", (unsigned) segment.offset,
+             (unsigned) (segment.offset + segment.length - 1), remote_path.c_str());
+  }
+  return ok;
+}
+#endif
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+void FTPHTTPProxy::mirror_task(void *arg) {
+  auto *proxy = static_cast<FTPHTTPProxy *>(arg);
+  uint32_t started = millis();
+  bool ok = proxy->mirror_sync();
+  ESP_LOGI(TAG, "Miroir %s en %u s", ok ? "à jour" : "incomplet", (unsigned) ((millis() - started) / 1000));
+
+  // Après un échec, nouvel essai plus tôt
+  uint32_t next_in = ok ? proxy->mirror_interval_ : std::min<uint32_t>(proxy->mirror_interval_, 60000);
+  proxy->mirror_next_ = millis() + next_in;
+  proxy->mirror_running_ = false;
+  vTaskDelete(nullptr);
+}
+
+bool FTPHTTPProxy::mirror_sync() {
+  if (!mirror_loaded_) {
+    mirror_load_manifest();
+    mirror_loaded_ = true;
+  }
+
+  // Débit borné pour ne pas priver les clients HTTP de la liaison
+  std::unique_ptr<TokenBucket> bucket;
+  if (mirror_rate_limit_ > 0) {
+    bucket.reset(new TokenBucket(mirror_rate_limit_, std::max<uint32_t>(mirror_rate_limit_ / 4, SHAPING_CHUNK)));
+  }
+
+  bool all_ok = true, changed = false;
+  for (const auto &dir : mirror_dirs_) {
+    std::set<std::string> seen;
+    if (!mirror_walk(dir, 0, seen, bucket.get(), changed)) {
+      // Parcours partiel : rien n'est supprimé, un fichier absent du listing
+      // peut simplement ne pas avoir été vu
+      all_ok = false;
+      continue;
+    }
+
+    std::string prefix = dir.empty() ? dir : dir + "/";
+    for (auto it = mirror_manifest_.lower_bound(prefix);
+         it != mirror_manifest_.end() && it->first.compare(0, prefix.size(), prefix) == 0;) {
+      if (seen.count(it->first) != 0) {
+        ++it;
+        continue;
+      }
+      ESP_LOGD(TAG, "Miroir : %s supprimé du serveur", it->first.c_str());
+      storage_->delete_file_direct(mirror_local_path(it->first));
+      it = mirror_manifest_.erase(it);
+      changed = true;
+    }
+  }
 
-  if (::connect(sock_, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0) {
-    ESP_LOGE(TAG, "Échec de connexion FTP : %d", errno);
-    ::close(sock_);
-    sock_ = -1;
+  if (changed && !mirror_save_manifest()) {
+    ESP_LOGW(TAG, "Échec d'écriture du manifeste du miroir");
     return false;
   }
+  return all_ok;
+}
 
-  char buffer[256];
-  int bytes_received = recv(sock_, buffer, sizeof(buffer) - 1, 0);
-  if (bytes_received <= 0 || !strstr(buffer, "220 ")) {
-    ESP_LOGE(TAG, "Message de bienvenue FTP non reçu");
-    ::close(sock_);
-    sock_ = -1;
+bool FTPHTTPProxy::mirror_walk(const std::string &dir, uint8_t depth, std::set<std::string> &seen,
+                               TokenBucket *bucket, bool &changed) {
+  DirListing listing;
+  if (!fetch_listing(dir, listing)) {
+    ESP_LOGW(TAG, "Miroir : listing de /%s impossible", dir.c_str());
+    return false;
+  }
+  // Répertoire racine du miroir : chaque niveau intermédiaire est créé
+  if (depth == 0) {
+    for (size_t slash = dir.find('/'); slash != std::string::npos; slash = dir.find('/', slash + 1)) {
+      storage_->create_directory_direct(mirror_local_path(dir.substr(0, slash)));
+    }
+  }
+  if (!dir.empty() && !storage_->create_directory_direct(mirror_local_path(dir))) {
     return false;
   }
 
-  // Authentification
-  snprintf(buffer, sizeof(buffer), "USER %s\r\n", username_.c_str());
-  send(sock_, buffer, strlen(buffer), 0);
-  recv(sock_, buffer, sizeof(buffer) - 1, 0);
+  bool ok = true;
+  for (const auto &entry : listing.entries) {
+    if (entry.name.find('/') != std::string::npos || entry.name == "." || entry.name == "..") {
+      continue;
+    }
+    std::string path = dir.empty() ? entry.name : dir + "/" + entry.name;
+    if (entry.is_dir) {
+      if (depth < 8) {
+        ok = mirror_walk(path, depth + 1, seen, bucket, changed) && ok;
+      }
+      continue;
+    }
+    seen.insert(path);
+
+    // Date absente (LIST) : seule la taille, et le CRC s'il est demandé, décident
+    auto it = mirror_manifest_.find(path);
+    bool same = it != mirror_manifest_.end() && entry.has_size && it->second.size == entry.size &&
+                (entry.mtime == 0 || it->second.mtime == entry.mtime);
+    uint32_t crc;
+    if (same && mirror_checksum_ && mirror_remote_crc(path, crc)) {
+      same = crc == it->second.crc;
+    }
+    if (same) {
+      continue;
+    }
+
+    MirrorEntry result;
+    if (!mirror_fetch(path, bucket, result)) {
+      ESP_LOGW(TAG, "Miroir : échec du téléchargement de %s", path.c_str());
+      ok = false;
+      continue;
+    }
+    mirror_manifest_[path] = result;
+    changed = true;
+  }
+  return ok;
+}
 
-  snprintf(buffer, sizeof(buffer), "PASS %s\r\n", password_.c_str());
-  send(sock_, buffer, strlen(buffer), 0);
-  recv(sock_, buffer, sizeof(buffer) - 1, 0);
+bool FTPHTTPProxy::mirror_fetch(const std::string &remote_path, TokenBucket *bucket, MirrorEntry &result) {
+  int data_sock;
+  RemoteFileInfo info;
+  FTPSession *session = begin_transfer(remote_path, &info, data_sock);
+  if (session == nullptr) {
+    return false;
+  }
+  // Sans taille, impossible de vérifier que la copie est complète
+  std::string local = mirror_local_path(remote_path);
+  FILE *file = info.has_size ? storage_->open_file_direct(local + ".part", "wb") : nullptr;
+  if (file == nullptr) {
+    sock_close(data_sock);
+    release_session(session, true);
+    return false;
+  }
+  if (!send_retr(session, remote_path, 0, data_sock)) {
+    fclose(file);
+    storage_->delete_file_direct(local + ".part");
+    return false;
+  }
 
-  // Mode binaire
-  send(sock_, "TYPE I\r\n", 8, 0);
-  recv(sock_, buffer, sizeof(buffer) - 1, 0);
+  uint32_t crc = MZ_CRC32_INIT;
+  size_t written = 0;
+  size_t remaining = SIZE_MAX;
+  bool relay_ok = relay_data(data_sock, remaining, [&](const char *data, size_t len) {
+    if (bucket != nullptr) {
+      bucket->consume(len);
+    }
+    crc = mz_crc32(crc, (const uint8_t *) data, len);
+    written += len;
+    return fwrite(data, 1, len, file) == len;
+  });
+  sock_close(data_sock);
+  bool ok = end_transfer(session, relay_ok, false) && written == info.size;
+  ok = fclose(file) == 0 && ok;
 
+  // Écriture atomique : l'ancienne copie n'est remplacée que par un fichier complet
+  if (!ok || !storage_->rename_file_direct(local + ".part", local)) {
+    storage_->delete_file_direct(local + ".part");
+    return false;
+  }
+  result.size = info.size;
+  result.mtime = info.mtime;
+  result.crc = crc;
   return true;
 }
 
-bool FTPHTTPProxy::download_file(const std::string &remote_path, httpd_req_t *req) {
-  // Déclarations en haut pour éviter les goto cross-initialization
-  int data_sock = -1;
-  bool success = false;
-  char *pasv_start = nullptr;
-  int data_port = 0;
-  int ip[4], port[2]; 
-  char buffer[1024]; // Tampon de 1ko pour réception
-  int bytes_received;
+bool FTPHTTPProxy::mirror_remote_crc(const std::string &remote_path, uint32_t &crc) {
+  // XCRC (FileZilla Server, ProFTPD mod_digest...) : CRC-32 calculé par le serveur
+  if (!mirror_xcrc_) {
+    return false;
+  }
+  bool reused;
+  FTPSession *session = acquire_session(reused);
+  if (session == nullptr) {
+    return false;
+  }
+  std::string response;
+  int code = ftp_command(*session, "XCRC " + remote_path, &response);
+  release_session(session, code != 0);
+  if (code == 500 || code == 502) {
+    ESP_LOGW(TAG, "XCRC non supporté : miroir comparé sur la taille et la date");
+    mirror_xcrc_ = false;
+  }
+  if (code / 100 != 2 || response.size() < 5) {
+    return false;
+  }
+  char *end;
+  crc = strtoul(response.c_str() + 4, &end, 16);
+  return end != response.c_str() + 4;
+}
+
+void FTPHTTPProxy::mirror_load_manifest() {
+  // Une ligne par fichier : "taille date crc chemin". Sans .manifest, le
+  // redémarrage a eu lieu entre la suppression et le renommage de
+  // mirror_save_manifest : .manifest.tmp est alors la dernière version. Aucun
+  // des deux au premier démarrage : rien à charger, pas d'erreur
+  std::string path = mirror_path_ + "/.manifest";
+  FILE *file = nullptr;
+  if (storage_->file_exists_direct(path)) {
+    file = storage_->open_file_direct(path, "r");
+  } else if (storage_->file_exists_direct(path + ".tmp")) {
+    ESP_LOGW(TAG, "Manifeste du miroir repris de %s.tmp", path.c_str());
+    file = storage_->open_file_direct(path + ".tmp", "r");
+  }
+  if (file == nullptr) {
+    return;
+  }
+  // Lignes incomplètes (écriture interrompue, chemin trop long) ignorées :
+  // leur fichier est simplement retéléchargé
+  char line[320];
+  bool complete = true;
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    bool previous_complete = complete;
+    size_t len = strlen(line);
+    complete = len > 0 && line[len - 1] == '\n';
+    if (!previous_complete || !complete) {
+      continue;
+    }
+    unsigned long size;
+    long long mtime;
+    unsigned long crc;
+    int path_pos = 0;
+    if (sscanf(line, "%lu %lld %lx %n", &size, &mtime, &crc, &path_pos) != 3 || path_pos == 0) {
+      continue;
+    }
+    std::string remote_path(line + path_pos);
+    while (!remote_path.empty() && (remote_path.back() == '\n' || remote_path.back() == '\r')) {
+      remote_path.pop_back();
+    }
+    if (remote_path.empty()) {
+      continue;
+    }
+    MirrorEntry &entry = mirror_manifest_[remote_path];
+    entry.size = size;
+    entry.mtime = mtime;
+    entry.crc = crc;
+  }
+  fclose(file);
+  ESP_LOGI(TAG, "Manifeste du miroir : %u fichiers", (unsigned) mirror_manifest_.size());
+}
+
+bool FTPHTTPProxy::mirror_save_manifest() {
+  // Réécrit dans .manifest.tmp puis renommé. Un redémarrage pendant l'écriture
+  // laisse l'ancien manifeste ; rename_file_direct supprime la cible avant de
+  // renommer (FAT), un redémarrage entre les deux ne laisse que le .tmp
+  // complet, repris par mirror_load_manifest
+  std::string path = mirror_path_ + "/.manifest";
+  FILE *file = storage_->open_file_direct(path + ".tmp", "w");
+  if (file == nullptr) {
+    return false;
+  }
+  bool ok = true;
+  for (const auto &it : mirror_manifest_) {
+    ok = fprintf(file, "%lu %lld %08lx %s\n", (unsigned long) it.second.size, (long long) it.second.mtime,
+                 (unsigned long) it.second.crc, it.first.c_str()) > 0 &&
+         ok;
+  }
+  ok = fclose(file) == 0 && ok;
+  return ok && storage_->rename_file_direct(path + ".tmp", path);
+}
+#endif
 
-  // Connexion au serveur FTP
-  if (!connect_to_ftp()) {
-    goto error;
+esp_err_t FTPHTTPProxy::http_req_handler(httpd_req_t *req) {
+  auto *proxy = (FTPHTTPProxy *)req->user_ctx;
+
+  // Suppression du premier slash et de la query string, sans copie
+  const char *path = req->uri;
+  if (*path == '/') {
+    path++;
   }
+  size_t path_len = strcspn(path, "?");
 
-  // Mode passif
-  send(sock_, "PASV\r\n", 6, 0);
-  bytes_received = recv(sock_, buffer, sizeof(buffer) - 1, 0);
-  if (bytes_received <= 0 || !strstr(buffer, "227 ")) {
-    goto error;
+  // Chemin en '/' : listing d'un répertoire autorisé. Les fichiers de ces
+  // répertoires sont servis comme les chemins déclarés, mais pas modifiables
+  bool upload = req->method == HTTP_PUT || req->method == HTTP_POST;
+  bool listing = path_len == 0 || path[path_len - 1] == '/';
+  bool allowed = listing ? !upload && proxy->match_listing(path, path_len > 0 ? path_len - 1 : 0)
+                         : proxy->match_route(path, path_len) || (!upload && proxy->match_listing(path, path_len));
+  if (!allowed) {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Fichier non trouvé");
+    return ESP_FAIL;
+  }
+  // Sans Content-Length (corps chunked), la fin du corps n'est pas vérifiable
+  if (upload && httpd_req_get_hdr_value_len(req, "Content-Length") == 0) {
+    httpd_resp_send_err(req, HTTPD_411_LENGTH_REQUIRED, "Content-Length requis");
+    return ESP_FAIL;
   }
 
-  // Extraction des données de connexion
-  pasv_start = strchr(buffer, '(');
-  if (!pasv_start) {
-    goto error;
+  // Les en-têtes sont lus ici, avant de confier la requête à un worker
+  auto *job = new TransferJob();
+  job->remote_path.assign(path, listing && path_len > 0 ? path_len - 1 : path_len);
+  job->upload = upload;
+  job->head = req->method == HTTP_HEAD;
+  job->listing = listing;
+  if (!job->upload) {
+    parse_range_header(req, job->range);
+    parse_conditional_headers(req, job->conditional);
+    job->accept_deflate = proxy->mode_z_ && accepts_deflate(req);
+  }
+  job->priority = proxy->priority_for(path, path_len);
+  if (proxy->client_rate_limit_ > 0) {
+    job->client = client_address(req);
   }
 
-  sscanf(pasv_start, "(%d,%d,%d,%d,%d,%d)", &ip[0], &ip[1], &ip[2], &ip[3], &port[0], &port[1]);
-  data_port = port[0] * 256 + port[1];
+  // File pleine : refus immédiat plutôt qu'une attente sans fin. Seule la
+  // tâche du serveur HTTP remplit la file, la place ne peut pas disparaître
+  // entre ce test et l'envoi
+  if (proxy->work_queue_ != nullptr && uxQueueSpacesAvailable(proxy->work_queue_) == 0) {
+    proxy->rejected_++;
+    if (proxy->trace_.enabled()) {
+      TraceRecord record;
+      record.queued_at = millis();
+      record.status = 503;
+      record.end = END_REJECTED;
+      proxy->trace_request(record, req, job->remote_path);
+    }
+    delete job;
+    return proxy->reject_busy(req);
+  }
 
-  // Création du socket de données
-  data_sock = ::socket(AF_INET, SOCK_STREAM, 0);
-  if (data_sock < 0) {
-    goto error;
+#ifdef FTP_HTTP_PROXY_ASYNC
+  if (proxy->work_queue_ != nullptr && httpd_req_async_handler_begin(req, &job->req) == ESP_OK) {
+    job->queued_at = millis();
+    if (job->priority == PRIORITY_HIGH) {
+      xQueueSendToFront(proxy->work_queue_, &job, portMAX_DELAY);
+    } else {
+      xQueueSend(proxy->work_queue_, &job, portMAX_DELAY);
+    }
+    return ESP_OK;
   }
+#endif
+
+  // Pas de worker disponible : transfert dans la tâche du serveur HTTP
+  job->req = req;
+  esp_err_t err = proxy->process_job(*job);
+  delete job;
+  return err;
+}
 
-  struct sockaddr_in data_addr;
-  memset(&data_addr, 0, sizeof(data_addr));
-  data_addr.sin_family = AF_INET;
-  data_addr.sin_port = htons(data_port);
-  data_addr.sin_addr.s_addr = htonl(
-      (ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3]
-  );
+// '*' et '?' ne traversent pas les '/' ; pattern terminé par NUL, text non
+static bool glob_match(const char *pattern, const char *text, size_t len) {
+  const char *star = nullptr;
+  size_t star_pos = 0;
+  size_t t = 0;
 
-  if (::connect(data_sock, (struct sockaddr *)&data_addr, sizeof(data_addr)) != 0) {
-    goto error;
+  while (t < len) {
+    if (*pattern == '*') {
+      star = ++pattern;
+      star_pos = t;
+    } else if (*pattern != '\0' && (*pattern == text[t] || (*pattern == '?' && text[t] != '/'))) {
+      pattern++;
+      t++;
+    } else if (star != nullptr && text[star_pos] != '/') {
+      // Retour arrière : l'étoile absorbe un caractère de plus
+      pattern = star;
+      t = ++star_pos;
+    } else {
+      return false;
+    }
   }
+  while (*pattern == '*') {
+    pattern++;
+  }
+  return *pattern == '\0';
+}
 
-  // Envoi de la commande RETR
-  snprintf(buffer, sizeof(buffer), "RETR %s\r\n", remote_path.c_str());
-  send(sock_, buffer, strlen(buffer), 0);
+bool FTPHTTPProxy::match_route(const char *path, size_t len) const {
+  // Chemins exacts : recherche dichotomique dans la liste triée par __init__.py
+  std::string_view key(path, len);
+  auto it = std::lower_bound(remote_paths_.begin(), remote_paths_.end(), key,
+                             [](const std::string &entry, std::string_view value) { return entry < value; });
+  if (it != remote_paths_.end() && *it == key) {
+    return true;
+  }
 
-  // Vérification de la réponse 150
-  bytes_received = recv(sock_, buffer, sizeof(buffer) - 1, 0);
-  if (bytes_received <= 0 || !strstr(buffer, "150 ")) {
-    goto error;
+  // Règles génériques : descente du trie des préfixes littéraux, puis glob
+  // sur le reste du chemin pour chaque règle rencontrée
+  if (route_nodes_ == nullptr || key.find("..") != std::string_view::npos) {
+    return false;
   }
+  uint16_t node = 0;
+  for (size_t i = 0;; i++) {
+    const RouteNode &current = route_nodes_[node];
+    for (uint16_t r = current.first_rule; r < current.first_rule + current.rule_count; r++) {
+      const RouteRule &rule = route_rules_[r];
+      if (glob_match(rule.pattern + rule.prefix_len, path + i, len - i)) {
+        return true;
+      }
+    }
+    if (i == len) {
+      return false;
+    }
 
-  // Transfert en streaming
-  while (true) {
-    bytes_received = recv(data_sock, buffer, sizeof(buffer), 0);
-    if (bytes_received <= 0) break;
+    const RouteEdge *first = route_edges_ + current.first_edge;
+    const RouteEdge *last = first + current.edge_count;
+    uint8_t ch = path[i];
+    const RouteEdge *edge =
+        std::lower_bound(first, last, ch, [](const RouteEdge &e, uint8_t value) { return e.ch < value; });
+    if (edge == last || edge->ch != ch) {
+      return false;
+    }
+    node = edge->node;
+  }
+}
 
-    if (httpd_resp_send_chunk(req, buffer, bytes_received) != ESP_OK) {
-      ESP_LOGE(TAG, "Échec d'envoi au client");
-      break;
+TransferPriority FTPHTTPProxy::priority_for(const char *path, size_t len) const {
+  // Première règle correspondante, dans l'ordre du YAML
+  for (const auto &rule : priority_rules_) {
+    if (glob_match(rule.pattern.c_str(), path, len)) {
+      return rule.priority;
     }
   }
+  return PRIORITY_NORMAL;
+}
 
-  // Vérification de la réponse finale 226
-  bytes_received = recv(sock_, buffer, sizeof(buffer) - 1, 0);
-  if (bytes_received > 0 && strstr(buffer, "226 ")) {
-    success = true;
+std::shared_ptr<TokenBucket> FTPHTTPProxy::client_bucket(const std::string &client) {
+  LockGuard lock(shaping_mutex_);
+  // Les seaux qu'aucune réponse n'utilise plus sont oubliés
+  for (auto it = client_buckets_.begin(); it != client_buckets_.end();) {
+    if (it->second.use_count() == 1 && it->first != client) {
+      it = client_buckets_.erase(it);
+    } else {
+      ++it;
+    }
   }
+  auto &bucket = client_buckets_[client];
+  if (bucket == nullptr) {
+    bucket = std::make_shared<TokenBucket>(client_rate_limit_,
+                                           std::max<uint32_t>(client_rate_limit_ / 4, SHAPING_CHUNK));
+  }
+  return bucket;
+}
 
-  // Fermeture des sockets
-  ::close(data_sock);
-  send(sock_, "QUIT\r\n", 6, 0);
-  ::close(sock_);
-  sock_ = -1;
+std::string FTPHTTPProxy::client_address(httpd_req_t *req) {
+  char text[INET6_ADDRSTRLEN];
+  client_address(req, text, sizeof(text));
+  return text;
+}
 
-  // Envoi du chunk final
-  httpd_resp_send_chunk(req, NULL, 0);
-  return success;
+void FTPHTTPProxy::client_address(httpd_req_t *req, char *text, size_t len) {
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  text[0] = '\0';
+  if (getpeername(httpd_req_to_sockfd(req), (struct sockaddr *) &addr, &addr_len) == 0) {
+    if (addr.ss_family == AF_INET6) {
+      inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &addr)->sin6_addr, text, len);
+    } else {
+      inet_ntop(AF_INET, &((struct sockaddr_in *) &addr)->sin_addr, text, len);
+    }
+  }
+}
 
-error:
-  if (data_sock != -1) ::close(data_sock);
-  if (sock_ != -1) {
-    send(sock_, "QUIT\r\n", 6, 0);
-    ::close(sock_);
-    sock_ = -1;
+esp_err_t FTPHTTPProxy::process_job(TransferJob &job) {
+  if (!trace_.enabled()) {
+    ResponseStream out(job.req);
+    return serve_job(job, out);
   }
-  return false;
+
+  TraceRecord record;
+  record.queued_at = job.queued_at;
+  record.phases[PHASE_QUEUE] = millis() - job.queued_at;
+  ResponseStream out(job.req);
+  out.set_trace(&record);
+  esp_err_t err = serve_job(job, out);
+
+  if (err == ESP_OK) {
+    record.end = END_COMPLETE;
+  } else {
+    record.end = out.failed() ? END_CLIENT : END_UPSTREAM;
+  }
+  // Réponse d'erreur envoyée par httpd_resp_send_err : la réponse n'a pas démarré
+  record.status = out.started() ? atoi(out.status()) : 500;
+  record.bytes = out.body_bytes();
+  trace_request(record, job.req, job.remote_path);
+  return err;
 }
 
-esp_err_t FTPHTTPProxy::http_req_handler(httpd_req_t *req) {
-  auto *proxy = (FTPHTTPProxy *)req->user_ctx;
-  std::string requested_path = req->uri;
+esp_err_t FTPHTTPProxy::serve_job(TransferJob &job, ResponseStream &out) {
+  if (client_rate_limit_ > 0 || global_bucket_ != nullptr) {
+    out.set_shaping(client_rate_limit_ > 0 ? client_bucket(job.client) : nullptr,
+                    job.priority == PRIORITY_HIGH ? nullptr : global_bucket_.get());
+  }
+  if (mode_z_) {
+    out.add_header("Vary", "Accept-Encoding");
+  }
+  if (job.upload) {
+    if (upload_file(job.remote_path, job.req)) {
+      out.set_status("204 No Content");
+      out.set_no_body();
+      return out.finish() ? ESP_OK : ESP_FAIL;
+    }
+    // Corps éventuellement non lu : la connexion est fermée après l'erreur
+    httpd_resp_send_err(job.req, HTTPD_500_INTERNAL_SERVER_ERROR, "Échec de l'envoi");
+    return ESP_FAIL;
+  }
 
-  // Suppression du premier slash
-  if (!requested_path.empty() && requested_path[0] == '/') {
-    requested_path.erase(0, 1);
+  if (job.listing) {
+    return serve_listing(job.remote_path, out, job.head) ? ESP_OK : ESP_FAIL;
   }
 
-  // Configuration du transfert par lots
-  httpd_resp_set_type(req, "text/plain");
-  
-  // La fonction httpd_resp_set_send_chunked n'existe pas
-  // On utilise directement httpd_resp_send_chunk à la place
+  out.set_content_type(content_type_for(job.remote_path));
+  out.add_header("Accept-Ranges", "bytes");
 
-  for (const auto &configured_path : proxy->remote_paths_) {
-    if (requested_path == configured_path) {
-      if (proxy->download_file(configured_path, req)) {
-        return ESP_OK;
-      } else {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Échec du téléchargement");
-        return ESP_FAIL;
+  // Fichier inchangé côté client : 304 sans canal de données
+  if (job.conditional.present() && send_not_modified(job.remote_path, job.conditional, out)) {
+    return ESP_OK;
+  }
+  if (job.head) {
+    return serve_head(job.remote_path, out) ? ESP_OK : ESP_FAIL;
+  }
+
+  if (download_file(job.remote_path, out, job.range, job.accept_deflate)) {
+    return ESP_OK;
+  }
+  // Réponse déjà commencée : seule la fermeture du socket prévient le client
+  if (!out.started()) {
+    httpd_resp_send_err(job.req, HTTPD_500_INTERNAL_SERVER_ERROR, "Échec du téléchargement");
+  }
+  return ESP_FAIL;
+}
+
+esp_err_t FTPHTTPProxy::metrics_handler(httpd_req_t *req) {
+  auto *proxy = static_cast<FTPHTTPProxy *>(req->user_ctx);
+  std::string body;
+  body.reserve(8192);
+  proxy->metrics_.render(body);
+
+  char line[256];
+  snprintf(line, sizeof(line),
+           "# TYPE ftp_proxy_queue_depth gauge\nftp_proxy_queue_depth %u\n"
+           "# TYPE ftp_proxy_active_transfers gauge\nftp_proxy_active_transfers %u\n"
+           "# TYPE ftp_proxy_rejected_total counter\nftp_proxy_rejected_total{reason=\"queue_full\"} %u\n"
+           "ftp_proxy_rejected_total{reason=\"queue_timeout\"} %u\n",
+           (unsigned) proxy->get_queue_depth(), (unsigned) proxy->active_, (unsigned) proxy->rejected_,
+           (unsigned) proxy->expired_);
+  body += line;
+
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  return httpd_resp_send(req, body.c_str(), body.size());
+}
+
+void FTPHTTPProxy::trace_request(TraceRecord &record, httpd_req_t *req, const std::string &remote_path) {
+  record.total_ms = millis() - record.queued_at;
+  // Chemin tronqué s'il dépasse le champ : on garde la fin, la plus parlante
+  size_t skip = remote_path.size() >= sizeof(record.path) ? remote_path.size() - sizeof(record.path) + 1 : 0;
+  strncpy(record.path, remote_path.c_str() + skip, sizeof(record.path) - 1);
+  client_address(req, record.client, sizeof(record.client));
+  record.method = req->method;
+  trace_.push(record);
+}
+
+esp_err_t FTPHTTPProxy::trace_handler(httpd_req_t *req) {
+  auto *proxy = static_cast<FTPHTTPProxy *>(req->user_ctx);
+  static const char *const SOURCES[] = {"none", "ram", "sd", "shared", "ftp", "segmented"};
+  static const char *const ENDS[] = {"complete", "client", "upstream", "rejected"};
+
+  // Une ligne JSON par trace, de la plus ancienne à la plus récente
+  httpd_resp_set_type(req, "application/x-ndjson");
+  uint32_t first, next;
+  proxy->trace_.bounds(first, next);
+  TraceRecord record;
+  char line[640];
+  for (uint32_t seq = first; seq < next; seq++) {
+    if (!proxy->trace_.read(seq, record)) {
+      continue;
+    }
+
+    // Seuls '"' et '\\' sont à échapper dans un chemin FTP
+    char path[2 * sizeof(record.path)];
+    size_t p = 0;
+    for (const char *c = record.path; *c != '\0'; c++) {
+      if (*c == '"' || *c == '\\') {
+        path[p++] = '\\';
+      }
+      path[p++] = (unsigned char) *c < 0x20 ? '?' : *c;
+    }
+    path[p] = '\0';
+
+    // Longueur bornée après chaque ajout : une ligne trop longue est tronquée
+    int n = 0;
+    auto append = [&](const char *format, auto... args) {
+      n += std::max(snprintf(line + n, sizeof(line) - n, format, args...), 0);
+      n = std::min<int>(n, sizeof(line) - 1);
+    };
+    append("{\"seq\":%u,\"at\":%u,\"method\":\"%s\",\"path\":\"%s\",\"client\":\"%s\","
+           "\"status\":%u,\"source\":\"%s\",\"end\":\"%s\",\"bytes\":%llu,\"total_ms\":%u,",
+           (unsigned) seq, (unsigned) record.queued_at, http_method_str((enum http_method) record.method), path,
+           record.client, (unsigned) record.status, SOURCES[record.source], ENDS[record.end],
+           (unsigned long long) record.bytes, (unsigned) record.total_ms);
+    if (record.upstream != 0xFF) {
+      append("\"upstream\":%u,\"retries\":%u,", (unsigned) record.upstream, (unsigned) record.retries);
+    }
+    append("\"ftp_codes\":[");
+    for (uint8_t i = 0; i < record.code_count; i++) {
+      append("%s%u", i > 0 ? "," : "", (unsigned) record.codes[i]);
+    }
+    append("],\"phases_ms\":{");
+    for (uint8_t phase = 0; phase < PHASE_COUNT; phase++) {
+      append("%s\"%s\":%u", phase > 0 ? "," : "", PHASE_NAMES[phase], (unsigned) record.phases[phase]);
+    }
+    append("}}\n");
+    if (httpd_resp_send_chunk(req, line, n) != ESP_OK) {
+      return ESP_FAIL;
+    }
+  }
+  return httpd_resp_send_chunk(req, nullptr, 0);
+}
+
+esp_err_t FTPHTTPProxy::reject_busy(httpd_req_t *req) {
+  // Délai suggéré : le temps maximal qu'aurait passé la requête dans la file
+  ResponseStream out(req);
+  out.set_status("503 Service Unavailable");
+  out.add_header("Retry-After", std::to_string(std::max<uint32_t>(1, (queue_timeout_ + 999) / 1000)));
+  out.set_content_length(0);
+  return out.finish() ? ESP_OK : ESP_FAIL;
+}
+
+#ifdef FTP_HTTP_PROXY_ASYNC
+void FTPHTTPProxy::worker_task(void *arg) {
+  auto *proxy = static_cast<FTPHTTPProxy *>(arg);
+  UBaseType_t base_priority = uxTaskPriorityGet(nullptr);
+  TransferJob *job;
+
+  while (true) {
+    if (xQueueReceive(proxy->work_queue_, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+
+    // Attente trop longue : le client aura plus vite fait de réessayer
+    esp_err_t err;
+    if (millis() - job->queued_at >= proxy->queue_timeout_) {
+      proxy->expired_++;
+      err = proxy->reject_busy(job->req);
+      if (proxy->trace_.enabled()) {
+        TraceRecord record;
+        record.queued_at = job->queued_at;
+        record.phases[PHASE_QUEUE] = millis() - job->queued_at;
+        record.status = 503;
+        record.end = END_REJECTED;
+        proxy->trace_request(record, job->req, job->remote_path);
+      }
+    } else {
+      proxy->metrics_.observe(PHASE_QUEUE, millis() - job->queued_at);
+      // Priorité de la tâche ajustée à la classe du chemin le temps du transfert
+      vTaskPrioritySet(nullptr, base_priority + job->priority - PRIORITY_NORMAL);
+      proxy->active_++;
+      err = proxy->process_job(*job);
+      proxy->active_--;
+      vTaskPrioritySet(nullptr, base_priority);
+    }
+    if (err != ESP_OK) {
+      // Équivalent du ESP_FAIL d'un handler synchrone
+      httpd_sess_trigger_close(job->req->handle, httpd_req_to_sockfd(job->req));
+    }
+    httpd_req_async_handler_complete(job->req);
+    delete job;
+  }
+}
+#endif
+
+bool FTPHTTPProxy::parse_range_header(httpd_req_t *req, ByteRange &range) {
+  char value[64];
+  if (httpd_req_get_hdr_value_str(req, "Range", value, sizeof(value)) != ESP_OK) {
+    return false;
+  }
+
+  // Les plages multiples ou mal formées sont ignorées : réponse complète
+  if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',') != nullptr) {
+    return false;
+  }
+  const char *spec = value + 6;
+  const char *dash = strchr(spec, '-');
+  if (dash == nullptr) {
+    return false;
+  }
+
+  char *end;
+  if (dash == spec) {
+    range.start = strtoul(dash + 1, &end, 10);
+    if (end == dash + 1 || *end != '\0' || range.start == 0) {
+      return false;
+    }
+    range.suffix = true;
+  } else {
+    range.start = strtoul(spec, &end, 10);
+    if (end != dash) {
+      return false;
+    }
+    if (dash[1] != '\0') {
+      range.end = strtoul(dash + 1, &end, 10);
+      if (*end != '\0' || range.end < range.start) {
+        return false;
       }
     }
   }
 
-  httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Fichier non trouvé");
-  return ESP_FAIL;
+  range.requested = true;
+  return true;
+}
+
+bool FTPHTTPProxy::accepts_deflate(httpd_req_t *req) {
+  char value[128];
+  if (httpd_req_get_hdr_value_str(req, "Accept-Encoding", value, sizeof(value)) != ESP_OK) {
+    return false;
+  }
+  // "deflate" présent et pas explicitement refusé par q=0
+  const char *token = strstr(value, "deflate");
+  if (token == nullptr) {
+    return false;
+  }
+  const char *end = token + strcspn(token, ",");
+  const char *q = strstr(token, "q=");
+  return q == nullptr || q > end || strtod(q + 2, nullptr) > 0;
+}
+
+void FTPHTTPProxy::parse_conditional_headers(httpd_req_t *req, ConditionalRequest &conditional) {
+  char value[128];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) == ESP_OK) {
+    conditional.if_none_match = value;
+  }
+
+  // Format IMF-fixdate uniquement : "Sun, 06 Nov 1994 08:49:37 GMT"
+  static const char *const MONTHS = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char month[4];
+  int d, y, hh, mi, ss;
+  if (httpd_req_get_hdr_value_str(req, "If-Modified-Since", value, sizeof(value)) == ESP_OK &&
+      sscanf(value, "%*3s, %d %3s %d %d:%d:%d GMT", &d, month, &y, &hh, &mi, &ss) == 6) {
+    const char *found = strstr(MONTHS, month);
+    if (found != nullptr && strlen(month) == 3 && (found - MONTHS) % 3 == 0) {
+      conditional.if_modified_since = utc_to_time(y, (found - MONTHS) / 3 + 1, d, hh, mi, ss);
+    }
+  }
+}
+
+const char *FTPHTTPProxy::content_type_for(const std::string &path) {
+  static const struct {
+    const char *ext;
+    const char *type;
+  } TYPES[] = {
+      {".bin", "application/octet-stream"}, {".json", "application/json"}, {".txt", "text/plain"},
+      {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"},
+      {".js", "application/javascript"}, {".xml", "application/xml"}, {".csv", "text/csv"},
+      {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"}, {".png", "image/png"},
+      {".gif", "image/gif"}, {".bmp", "image/bmp"}, {".svg", "image/svg+xml"},
+      {".mp3", "audio/mpeg"}, {".wav", "audio/wav"}, {".mp4", "video/mp4"},
+      {".pdf", "application/pdf"}, {".zip", "application/zip"}, {".gz", "application/gzip"},
+  };
+
+  size_t dot = path.rfind('.');
+  if (dot != std::string::npos) {
+    for (const auto &entry : TYPES) {
+      if (strcasecmp(path.c_str() + dot, entry.ext) == 0) {
+        return entry.type;
+      }
+    }
+  }
+  return "application/octet-stream";
 }
 
 void FTPHTTPProxy::setup_http_server() {
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.server_port = local_port_;
   config.uri_match_fn = httpd_uri_match_wildcard;
+  // Chaque transfert en cours et chaque requête en file garde son socket
+  // ouvert ; un de plus pour répondre 503 quand la file est pleine, un autre
+  // pour /status et /metrics. CONFIG_LWIP_MAX_SOCKETS est dimensionné en
+  // conséquence par __init__.py
+  int needed = max_concurrent_ + queue_size_ + 3;
+  config.max_open_sockets = needed;
+#ifdef CONFIG_LWIP_MAX_SOCKETS
+  // httpd_start exige max_open_sockets + 3 <= CONFIG_LWIP_MAX_SOCKETS, et les
+  // sockets FTP (contrôle + données par session du pool, sonde de santé)
+  // viennent de la même réserve lwIP. Si elle ne suffit pas (sdkconfig forcé
+  // à la main), la file est raccourcie pour que le refus 503 reste atteignable
+  int ftp_sockets = 2 * pool_size_ + 1;
+  int available = CONFIG_LWIP_MAX_SOCKETS - 3 - ftp_sockets;
+  if (needed > available) {
+    int queue = std::max(available - max_concurrent_ - 3, 1);
+    ESP_LOGE(TAG, "CONFIG_LWIP_MAX_SOCKETS=%d insuffisant pour %d sockets HTTP et %d FTP, file réduite à %d",
+             CONFIG_LWIP_MAX_SOCKETS, needed, ftp_sockets, queue);
+    queue_size_ = queue;
+    config.max_open_sockets = std::max(available, 1);
+  }
+#endif
+  config.lru_purge_enable = true;
+  // Sans worker, les transferts s'exécutent dans la tâche du serveur HTTP
+  config.stack_size += TLS_STACK_EXTRA;
 
   if (httpd_start(&server_, &config) != ESP_OK) {
     ESP_LOGE(TAG, "Échec du démarrage du serveur HTTP");
     return;
   }
 
+  // Enregistré avant "/*" : les handlers sont essayés dans l'ordre
+  if (metrics_endpoint_) {
+    httpd_uri_t uri_metrics = {
+      .uri       = "/metrics",
+      .method    = HTTP_GET,
+      .handler   = metrics_handler,
+      .user_ctx  = this
+    };
+    httpd_register_uri_handler(server_, &uri_metrics);
+  }
+  if (trace_.enabled()) {
+    httpd_uri_t uri_trace = {
+      .uri       = "/trace",
+      .method    = HTTP_GET,
+      .handler   = trace_handler,
+      .user_ctx  = this
+    };
+    httpd_register_uri_handler(server_, &uri_trace);
+  }
+
   httpd_uri_t uri_proxy = {
     .uri       = "/*",
     .method    = HTTP_GET,
@@ -212,7 +3986,36 @@ void FTPHTTPProxy::setup_http_server() {
   };
 
   httpd_register_uri_handler(server_, &uri_proxy);
+  uri_proxy.method = HTTP_HEAD;
+  httpd_register_uri_handler(server_, &uri_proxy);
+
+  // Envoi vers le serveur FTP, sur les mêmes chemins autorisés (405 sinon)
+  if (allow_upload_) {
+    uri_proxy.method = HTTP_PUT;
+    httpd_register_uri_handler(server_, &uri_proxy);
+    uri_proxy.method = HTTP_POST;
+    httpd_register_uri_handler(server_, &uri_proxy);
+  }
   ESP_LOGI(TAG, "Serveur HTTP démarré sur le port %d", local_port_);
+
+  // Workers de transfert : jusqu'à max_concurrent téléchargements simultanés,
+  // queue_size requêtes en attente au-delà
+#ifndef FTP_HTTP_PROXY_ASYNC
+  ESP_LOGW(TAG, "ESP-IDF < 5.1 : pas de handlers asynchrones, transferts dans la tâche HTTP");
+#else
+  work_queue_ = xQueueCreate(queue_size_, sizeof(TransferJob *));
+  if (work_queue_ == nullptr) {
+    ESP_LOGW(TAG, "File de travail indisponible, transferts dans la tâche HTTP");
+    return;
+  }
+  for (uint8_t i = 0; i < max_concurrent_; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "ftp_worker_%u", i);
+    if (xTaskCreate(worker_task, name, 6144 + TLS_STACK_EXTRA, this, tskIDLE_PRIORITY + 5, nullptr) != pdPASS) {
+      ESP_LOGW(TAG, "Impossible de créer le worker %u", i);
+    }
+  }
+#endif
 }
 
 }  // namespace ftp_http_proxy
@@ -1,41 +1,885 @@
 #pragma once
 
 #include "esphome.h"
+#include "esphome/core/defines.h"
+#include "esphome/core/helpers.h"
 #include <vector>
 #include <string>
+#include <string_view>
+#include <ctime>
+#include <atomic>
+#include <functional>
 #include <esp_http_server.h>
+#include <esp_idf_version.h>
 #include <lwip/sockets.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <map>
+#include <set>
+#include <memory>
+#include <esp_heap_caps.h>
+#include <rom/miniz.h>
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+#include "../storage/storage.h"
+#endif
+#ifdef USE_SENSOR
+#include "esphome/components/sensor/sensor.h"
+#endif
+#ifdef USE_FTP_HTTP_PROXY_TLS
+#include <mbedtls/ssl.h>
+#include <mbedtls/version.h>
+#include <mbedtls/net_sockets.h>
+#endif
+
+// httpd_req_async_handler_begin n'existe qu'à partir d'ESP-IDF 5.1 : avant,
+// pas de workers, chaque transfert s'exécute dans la tâche du serveur HTTP
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+#define FTP_HTTP_PROXY_ASYNC
+#endif
 
 namespace esphome {
 namespace ftp_http_proxy {
 
+#ifdef USE_FTP_HTTP_PROXY_TLS
+// Session TLS négociée, présentée à la connexion suivante pour une reprise
+// abrégée (identifiant de session ou ticket)
+struct TlsSession {
+  TlsSession() { mbedtls_ssl_session_init(&session); }
+  ~TlsSession() { mbedtls_ssl_session_free(&session); }
+  TlsSession(const TlsSession &) = delete;
+  TlsSession &operator=(const TlsSession &) = delete;
+
+  mbedtls_ssl_session session;
+};
+
+// Canal TLS client sur un socket déjà connecté. Le socket reste à l'appelant
+class TlsChannel {
+ public:
+  TlsChannel();
+  ~TlsChannel();
+
+  bool handshake(int sock, const mbedtls_ssl_config *conf, const char *host, const TlsSession *resume);
+  bool save_session(TlsSession &session) { return mbedtls_ssl_get_session(&ssl_, &session.session) == 0; }
+  int read(char *data, size_t len);  // 0 : fin du flux, < 0 : erreur
+  int write(const char *data, size_t len);
+  // Fermeture brutale : pas de close_notify, le pair doit voir une erreur
+  void abandon() { established_ = false; }
+
+ protected:
+  mbedtls_ssl_context ssl_;
+  mbedtls_net_context net_;
+  bool established_{false};
+};
+#endif
+
+// Durées de mise en place de la dernière connexion de contrôle (ms)
+struct ConnectTimings {
+  uint32_t dns{0};
+  uint32_t connect{0};
+  uint32_t login{0};
+};
+
+// Mesures d'un téléchargement, rapportées aux métriques et à la trace
+struct TransferStats {
+  ConnectTimings setup;
+  uint32_t control_ms{0};
+  uint32_t retr_sent{0};      // millis() à l'envoi de RETR
+  bool first_byte{false};
+  uint32_t first_byte_at{0};  // millis() au premier octet de données
+  uint32_t client_ms{0};      // temps passé à écrire vers le client
+  uint64_t bytes{0};
+};
+
+struct TraceRecord;
+
+// Connexion de contrôle FTP authentifiée, conservée dans le pool
+struct FTPSession {
+  int sock{-1};
+  struct sockaddr_storage peer{};  // adresse du serveur, réutilisée pour EPSV
+  socklen_t peer_len{0};
+  uint8_t upstream{0};  // index dans upstreams_
+  bool mode_z{false};   // MODE Z actif sur cette connexion
+  bool in_use{false};
+  uint32_t last_used{0};   // millis() de la dernière utilisation
+  uint32_t last_check{0};  // millis() du dernier NOOP
+  std::string rx;          // octets reçus au-delà de la dernière réponse lue
+  ConnectTimings timings;  // remis à zéro par le transfert qui les rapporte
+  TraceRecord *trace{nullptr};  // reçoit les codes de réponse pendant un transfert
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  std::shared_ptr<TlsSession> tls_session;  // reprise par les canaux de données
+#endif
+};
+
+// Adresses résolues du serveur FTP, rafraîchies en tâche de fond
+struct ResolvedServer {
+  static const uint8_t MAX_ADDRESSES = 4;
+  struct sockaddr_storage addrs[MAX_ADDRESSES];
+  socklen_t lens[MAX_ADDRESSES];
+  uint8_t count{0};
+  uint32_t resolved_at{0};
+};
+
+// Serveur FTP amont et état vu par le répartiteur de charge
+struct Upstream {
+  std::string host;
+  uint16_t port{21};
+  std::string username;
+  std::string password;
+  uint8_t weight{1};
+  ResolvedServer dns;       // sous dns_mutex_
+  bool healthy{true};       // sous pool_mutex_, comme les deux champs suivants
+  uint8_t outstanding{0};   // sessions du pool prises par des transferts
+  uint32_t checked_at{0};   // millis() du dernier contrôle de santé ou échec
+  int8_t mode_z{-1};        // MODE Z : -1 inconnu, 0 refusé, 1 accepté
+  int8_t mlsd{-1};          // MLSD : -1 inconnu, 0 absent (LIST), 1 présent
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  std::shared_ptr<TlsSession> tls_session;  // sous pool_mutex_, reprise à la reconnexion
+#endif
+};
+
+// Plage demandée via l'en-tête HTTP Range (bytes=a-b, bytes=a- ou bytes=-n)
+struct ByteRange {
+  bool requested{false};
+  bool suffix{false};    // bytes=-n : start contient n
+  size_t start{0};
+  size_t end{SIZE_MAX};  // inclus, SIZE_MAX = jusqu'à la fin du fichier
+};
+
+// Métadonnées d'un fichier distant obtenues par SIZE / MDTM
+struct RemoteFileInfo {
+  bool has_size{false};
+  size_t size{0};
+  time_t mtime{0};  // 0 si MDTM n'est pas supporté
+};
+
+// Seau à jetons : débit moyen rate octets/s, rafale d'au plus burst octets.
+// Les jetons sont comptés en millionièmes d'octet pour ne rien perdre aux
+// arrondis ; un solde négatif est une dette que le consommateur attend
+class TokenBucket {
+ public:
+  TokenBucket(uint32_t rate, uint32_t burst);
+
+  // Bloque le temps nécessaire pour que len octets respectent le débit
+  void consume(size_t len);
+
+ protected:
+  Mutex mutex_;
+  uint32_t rate_;
+  int64_t burst_;
+  int64_t tokens_;
+  uint32_t last_;  // micros() du dernier remplissage
+};
+
+// Phases mesurées d'un transfert, en millisecondes
+enum MetricPhase : uint8_t {
+  PHASE_QUEUE,       // attente dans la file de travail
+  PHASE_DNS,         // résolution du serveur (souvent servie par le cache)
+  PHASE_CONNECT,     // connexion TCP de contrôle
+  PHASE_LOGIN,       // bienvenue, USER/PASS/TYPE
+  PHASE_CONTROL,     // SIZE/MDTM, PASV/EPSV et connexion de données
+  PHASE_FIRST_BYTE,  // de RETR au premier octet de données
+  PHASE_TRANSFER,    // du premier octet à la fin du transfert
+  PHASE_CLIENT,      // temps bloqué à envoyer au client
+  PHASE_COUNT,
+};
+
+// Histogramme à bornes fixes ; les compteurs sont cumulés à l'export
+struct Histogram {
+  static const uint8_t BOUNDS = 13;
+  uint32_t counts[BOUNDS + 1]{};  // le dernier compte les valeurs au-delà de la dernière borne
+  uint32_t count{0};
+  uint64_t sum{0};
+
+  void observe(uint32_t value, const uint32_t *bounds);
+};
+
+// Histogrammes des phases et du débit des transferts FTP, exportés au
+// format texte Prometheus et résumés pour les capteurs
+class ProxyMetrics {
+ public:
+  void observe(MetricPhase phase, uint32_t ms);
+  void record_transfer(uint64_t bytes, uint32_t transfer_ms, bool ok);
+  // Moyennes depuis l'appel précédent ; false si aucun transfert n'a eu lieu
+  bool take_window(float &throughput, float &first_byte_ms);
+  void render(std::string &out) const;
+
+ protected:
+  mutable Mutex mutex_;
+  Histogram phases_[PHASE_COUNT];
+  Histogram throughput_;  // octets/s par transfert
+  uint64_t bytes_{0};
+  uint32_t completed_{0};
+  uint32_t failed_{0};
+
+  uint64_t window_bytes_{0};
+  uint64_t window_ms_{0};
+  uint64_t window_first_byte_{0};
+  uint32_t window_first_bytes_{0};
+};
+
+// Origine des octets d'une réponse
+enum TraceSource : uint8_t { SOURCE_NONE, SOURCE_RAM, SOURCE_SD, SOURCE_SHARED, SOURCE_FTP, SOURCE_SEGMENTED };
+
+// Issue d'une requête
+enum TraceEnd : uint8_t { END_COMPLETE, END_CLIENT, END_UPSTREAM, END_REJECTED };
+
+// Trace d'une requête, de taille fixe : remplie sur la pile du worker puis
+// copiée telle quelle dans l'anneau, sans allocation
+struct TraceRecord {
+  static const uint8_t MAX_CODES = 12;
+  uint32_t queued_at{0};  // millis() d'arrivée
+  uint32_t total_ms{0};
+  uint32_t phases[PHASE_COUNT]{};
+  uint64_t bytes{0};  // octets de corps envoyés au client
+  uint16_t status{0};
+  uint16_t codes[MAX_CODES]{};  // réponses FTP, dans l'ordre
+  uint8_t code_count{0};
+  uint8_t upstream{0xFF};
+  uint8_t retries{0};
+  uint8_t method{HTTP_GET};  // httpd_method_t de la requête
+  TraceSource source{SOURCE_NONE};
+  TraceEnd end{END_COMPLETE};
+  char path[64]{};
+  char client[INET6_ADDRSTRLEN]{};
+
+  void add_code(int code) {
+    if (code_count < MAX_CODES) {
+      codes[code_count++] = code;
+    }
+  }
+};
+
+// Anneau des dernières traces, alloué une fois au démarrage
+class TraceRing {
+ public:
+  ~TraceRing() { heap_caps_free(records_); }
+
+  bool init(size_t capacity);
+  bool enabled() const { return records_ != nullptr; }
+  void push(const TraceRecord &record);
+  // Numéros de la plus ancienne trace conservée et de la prochaine à écrire
+  void bounds(uint32_t &first, uint32_t &next) const;
+  // false si la trace a été écrasée entre-temps
+  bool read(uint32_t seq, TraceRecord &record) const;
+
+ protected:
+  mutable Mutex mutex_;
+  TraceRecord *records_{nullptr};
+  size_t capacity_{0};
+  uint32_t next_{0};
+};
+
+// Classe de priorité d'un chemin, choisie dans le YAML
+enum TransferPriority : uint8_t { PRIORITY_BULK, PRIORITY_NORMAL, PRIORITY_HIGH };
+
+struct PriorityRule {
+  std::string pattern;
+  TransferPriority priority;
+};
+
+// Réponse HTTP écrite directement sur le socket : Content-Length fixe quand
+// la taille est connue, sinon Transfer-Encoding: chunked. Les en-têtes
+// partent avec le premier write() ou finish(). Tous les octets destinés au
+// client passent par send_all(), seul point de contact avec le socket
+class ResponseStream {
+ public:
+  explicit ResponseStream(httpd_req_t *req) : req_(req), sock_(httpd_req_to_sockfd(req)) {}
+
+  void set_status(const char *status) { status_ = status; }
+  void set_content_type(const char *type) { content_type_ = type; }
+  void set_content_length(size_t length) {
+    content_length_ = length;
+    chunked_ = false;
+  }
+  void set_no_body() {
+    no_body_ = true;
+    chunked_ = false;
+  }
+  void add_header(const char *name, const std::string &value);
+  void remove_header(const char *name);
+  void set_trace(TraceRecord *trace) { trace_ = trace; }
+  TraceRecord *trace() const { return trace_; }
+  void set_source(TraceSource source) {
+    if (trace_ != nullptr) {
+      trace_->source = source;
+    }
+  }
+  void set_shaping(std::shared_ptr<TokenBucket> client, TokenBucket *global) {
+    client_bucket_ = std::move(client);
+    global_bucket_ = global;
+  }
+
+  bool write(const char *data, size_t len);
+  bool finish();
+  bool started() const { return started_; }
+  bool failed() const { return failed_; }
+  const char *status() const { return status_; }
+  uint64_t body_bytes() const { return body_bytes_; }
+
+ protected:
+  bool begin();
+  // more : d'autres octets suivent aussitôt, le segment TCP n'est pas poussé
+  bool send_all(const char *data, size_t len, bool more = false);
+  bool write_chunk(const char *data, size_t len);
+
+  httpd_req_t *req_;
+  int sock_;
+  const char *status_{"200 OK"};
+  const char *content_type_{"application/octet-stream"};
+  std::string headers_;
+  size_t content_length_{0};
+  bool chunked_{true};
+  bool no_body_{false};
+  bool started_{false};
+  bool failed_{false};  // le client n'accepte plus d'octets
+  uint64_t body_bytes_{0};
+  TraceRecord *trace_{nullptr};
+  std::shared_ptr<TokenBucket> client_bucket_;
+  TokenBucket *global_bucket_{nullptr};
+};
+
+// Fichier du cache SD, indexé par chemin distant
+struct CacheEntry {
+  size_t size{0};
+  time_t mtime{0};
+  bool validated{false};     // SIZE/MDTM vérifiés depuis le démarrage
+  uint32_t validated_at{0};  // millis() de la dernière vérification
+};
+
+// Fichier du miroir, tel qu'enregistré dans le manifeste de la carte
+struct MirrorEntry {
+  size_t size{0};
+  time_t mtime{0};
+  uint32_t crc{0};  // CRC-32 du contenu, calculé pendant le téléchargement
+};
+
+// Fichier préchargé en RAM (PSRAM si présente), partagé avec les réponses
+// en cours : un rafraîchissement remplace l'entrée sans toucher aux lecteurs
+struct RamFile {
+  ~RamFile() { heap_caps_free(data); }
+
+  RemoteFileInfo info;
+  char *data{nullptr};
+  uint32_t validated_at{0};  // millis() de la dernière vérification, sous ram_mutex_
+};
+
+// Destination des octets relayés ; renvoie false pour interrompre le relais
+using RelaySink = std::function<bool(const char *data, size_t len)>;
+
+// Relais en deux étages : une tâche lit le socket de données dans les blocs
+// libres pendant que l'appelant envoie les blocs déjà remplis au client
+class RelayPipe {
+ public:
+  ~RelayPipe();
+
+  bool init(size_t block_size, size_t depth);
+  bool start(int data_sock, size_t remaining);
+  // Renvoie false si le sink a échoué ; remaining reçoit ce qui reste à lire
+  bool drain(const RelaySink &sink, size_t &remaining);
+
+ protected:
+  static void producer_task(void *arg);
+  char *block(uint8_t index) { return storage_ + index * block_size_; }
+
+  char *storage_{nullptr};
+  std::vector<int> lengths_;
+  size_t block_size_{0};
+  QueueHandle_t free_q_{nullptr};
+  QueueHandle_t full_q_{nullptr};
+  SemaphoreHandle_t done_{nullptr};
+  int data_sock_{-1};
+  size_t remaining_{0};
+  std::atomic<bool> abort_{false};
+};
+
+// Décompression en flux d'un canal MODE Z (format zlib, RFC 1950) avec le
+// tinfl de la ROM ; la fenêtre de 32 Kio sert aussi de tampon de sortie
+class Inflater {
+ public:
+  ~Inflater();
+
+  bool init();
+  // Renvoie false si le flux est invalide ou si le sink a échoué
+  bool feed(const char *data, size_t len, const RelaySink &sink);
+  bool finished() const { return done_; }
+
+ protected:
+  tinfl_decompressor *decomp_{nullptr};
+  uint8_t *dict_{nullptr};
+  size_t dict_pos_{0};
+  bool done_{false};
+};
+
+// Suiveur d'un transfert partagé : position de lecture dans le flux
+struct SharedReader {
+  size_t pos{0};
+  bool evicted{false};  // détaché par le meneur car trop lent
+};
+
+// Téléchargement FTP partagé entre les clients qui demandent le même fichier.
+// Le meneur remplit un anneau que les suiveurs lisent à leur rythme ; il
+// attend le plus lent avant d'écraser des octets non lus
+struct SharedTransfer {
+  enum State : uint8_t { STARTING, STREAMING, DONE, FAILED };
+  ~SharedTransfer() { heap_caps_free(ring); }
+
+  Mutex mutex;
+  State state{STARTING};
+  RemoteFileInfo info;
+  char *ring{nullptr};
+  size_t capacity{0};
+  size_t produced{0};  // octets écrits depuis le début du fichier
+  std::vector<SharedReader *> readers;
+};
+
+// En-têtes de requête conditionnelle (If-None-Match / If-Modified-Since)
+struct ConditionalRequest {
+  std::string if_none_match;
+  time_t if_modified_since{0};
+
+  bool present() const { return !if_none_match.empty() || if_modified_since != 0; }
+};
+
+// Métadonnées récentes d'un fichier distant, pour répondre 304 sans FTP
+struct MetaEntry {
+  RemoteFileInfo info;
+  uint32_t fetched_at{0};
+};
+
+// Entrée d'un listing de répertoire (MLSD, ou LIST à défaut)
+struct DirEntry {
+  std::string name;
+  bool is_dir{false};
+  bool has_size{false};
+  size_t size{0};
+  time_t mtime{0};  // 0 si inconnu : les dates de LIST sont trop imprécises
+};
+
+struct DirListing {
+  std::vector<DirEntry> entries;
+  uint32_t fetched_at{0};
+};
+
+// Table de routage des règles génériques (firmware/*.bin), générée par
+// __init__.py : trie des préfixes littéraux, arêtes triées par caractère
+struct RouteNode {
+  uint16_t first_edge;
+  uint8_t edge_count;
+  uint16_t first_rule;
+  uint8_t rule_count;
+};
+
+struct RouteEdge {
+  uint8_t ch;
+  uint16_t node;
+};
+
+struct RouteRule {
+  const char *pattern;
+  uint16_t prefix_len;  // longueur du préfixe littéral déjà vérifié par le trie
+};
+
+// Requête confiée à un worker : copie asynchrone et en-têtes déjà analysés
+struct TransferJob {
+  httpd_req_t *req{nullptr};
+  std::string remote_path;
+  ByteRange range;
+  ConditionalRequest conditional;
+  bool upload{false};  // PUT/POST : corps relayé vers STOR
+  bool head{false};    // HEAD : en-têtes seuls, tirés des métadonnées
+  bool listing{false};  // chemin en '/' : listing JSON du répertoire
+  bool accept_deflate{false};
+  TransferPriority priority{PRIORITY_NORMAL};
+  std::string client;     // adresse IP du client, pour la limite de débit
+  uint32_t queued_at{0};  // millis() de mise en file
+};
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+class FTPHTTPProxy;
+
+// Segment d'un téléchargement parallèle, écrit à son offset dans le fichier
+// préalloué du cache SD par sa propre tâche
+struct Segment {
+  FTPHTTPProxy *proxy{nullptr};
+  const std::string *remote_path{nullptr};
+  const std::string *tmp_path{nullptr};
+  RemoteFileInfo info;
+  size_t offset{0};
+  size_t length{0};
+  FTPSession *session{nullptr};  // connexion déjà prête (premier segment)
+  int data_sock{-1};
+  bool ok{false};
+  SemaphoreHandle_t done{nullptr};
+};
+#endif
+
 class FTPHTTPProxy : public Component {
  public:
-  void set_ftp_server(const std::string &server) { ftp_server_ = server; }
-  void set_username(const std::string &username) { username_ = username; }
-  void set_password(const std::string &password) { password_ = password; }
+  void add_upstream(const std::string &host, uint16_t port, const std::string &username, const std::string &password,
+                    uint8_t weight) {
+    Upstream upstream;
+    upstream.host = host;
+    upstream.port = port;
+    upstream.username = username;
+    upstream.password = password;
+    upstream.weight = weight;
+    upstreams_.push_back(upstream);
+  }
+  void set_health_check_interval(uint32_t ms) { health_check_interval_ = ms; }
   void add_remote_path(const std::string &path) { remote_paths_.push_back(path); }
+  void set_route_table(const RouteNode *nodes, const RouteEdge *edges, const RouteRule *rules) {
+    route_nodes_ = nodes;
+    route_edges_ = edges;
+    route_rules_ = rules;
+  }
   void set_local_port(uint16_t port) { local_port_ = port; }
+  void set_pool_size(uint8_t size) { pool_size_ = size; }
+  void set_idle_timeout(uint32_t ms) { idle_timeout_ = ms; }
+  void set_keepalive_interval(uint32_t ms) { keepalive_interval_ = ms; }
+  void set_connect_timeout(uint32_t ms) { connect_timeout_ = ms; }
+  void set_dns_ttl(uint32_t ms) { dns_ttl_ = ms; }
+  void set_chunk_size(size_t size) { chunk_size_ = size; }
+  void set_buffer_count(uint8_t count) { buffer_count_ = count; }
+  void set_max_concurrent(uint8_t count) { max_concurrent_ = count; }
+  void set_client_rate_limit(uint32_t rate) { client_rate_limit_ = rate; }
+  void set_global_rate_limit(uint32_t rate) { global_rate_limit_ = rate; }
+  void add_priority_rule(const std::string &pattern, TransferPriority priority) {
+    priority_rules_.push_back({pattern, priority});
+  }
+  void set_queue_size(uint8_t size) { queue_size_ = size; }
+  void set_queue_timeout(uint32_t ms) { queue_timeout_ = ms; }
+  void set_coalesce_buffer(size_t size) { coalesce_buffer_ = size; }
+  void set_metadata_ttl(uint32_t ms) { metadata_ttl_ = ms; }
+  void add_listing_dir(const std::string &dir) { listing_dirs_.push_back(dir); }
+  void set_listing_ttl(uint32_t ms) { listing_ttl_ = ms; }
+  void set_mode_z(bool enabled) { mode_z_ = enabled; }
+  void set_max_retries(uint8_t count) { max_retries_ = count; }
+  void set_retry_backoff(uint32_t ms) { retry_backoff_ = ms; }
+  void set_allow_upload(bool allow) { allow_upload_ = allow; }
+  void set_upload_chunk_size(size_t size) { upload_chunk_size_ = size; }
+  void set_prefetch(bool prefetch) { prefetch_ = prefetch; }
+  void set_refresh_interval(uint32_t ms) { refresh_interval_ = ms; }
+  void set_prefetch_ram_limit(size_t size) { prefetch_ram_limit_ = size; }
+  void set_prefetch_ram_budget(size_t size) { prefetch_ram_budget_ = size; }
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  void set_storage_component(storage::StorageComponent *storage) { storage_ = storage; }
+  void set_cache_dir(const std::string &dir) { cache_dir_ = dir; }
+  void set_cache_ttl(uint32_t ms) { cache_ttl_ = ms; }
+  void set_segments(uint8_t count) { segments_ = count; }
+  void set_segment_min_size(size_t size) { segment_min_size_ = size; }
+  void add_mirror_dir(const std::string &dir) { mirror_dirs_.push_back(dir); }
+  void set_mirror_path(const std::string &path) { mirror_path_ = path; }
+  void set_mirror_interval(uint32_t ms) { mirror_interval_ = ms; }
+  void set_mirror_rate_limit(uint32_t rate) { mirror_rate_limit_ = rate; }
+  void set_mirror_checksum(bool checksum) { mirror_checksum_ = checksum; }
+#endif
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  void set_tls_verify(bool verify) { tls_verify_ = verify; }
+#endif
+
+  // État de l'admission, pour les lambdas et capteurs
+  uint32_t get_queue_depth() const { return work_queue_ != nullptr ? uxQueueMessagesWaiting(work_queue_) : 0; }
+  uint32_t get_active_transfers() const { return active_; }
+  uint32_t get_rejected_count() const { return rejected_; }
+  uint32_t get_expired_count() const { return expired_; }
+
+  // Histogrammes exposés sur /metrics (optionnel) et résumés par les capteurs
+  void set_metrics_endpoint(bool enabled) { metrics_endpoint_ = enabled; }
+  void set_trace_size(uint16_t size) { trace_size_ = size; }
+#ifdef USE_SENSOR
+  void set_throughput_sensor(sensor::Sensor *sensor) { throughput_sensor_ = sensor; }
+  void set_first_byte_sensor(sensor::Sensor *sensor) { first_byte_sensor_ = sensor; }
+#endif
 
   void setup() override;
   void loop() override;
   float get_setup_priority() const override { return esphome::setup_priority::AFTER_WIFI; }
 
  protected:
-  std::string ftp_server_;
-  std::string username_;
-  std::string password_;
-  std::vector<std::string> remote_paths_;
+  std::vector<std::string> remote_paths_;  // chemins exacts, triés
+  const RouteNode *route_nodes_{nullptr};
+  const RouteEdge *route_edges_{nullptr};
+  const RouteRule *route_rules_{nullptr};
   uint16_t local_port_{8000};
   httpd_handle_t server_{nullptr};
-  int sock_{-1};
-  int ftp_port_ = 21;
-  bool send_ftp_command(const std::string &cmd, std::string &response);
 
-  bool connect_to_ftp();
-  bool download_file(const std::string &remote_path, httpd_req_t *req);
+  // Serveurs FTP amont : le moins chargé (relativement à son poids) parmi
+  // ceux en bonne santé reçoit la requête, les autres servent de repli
+  std::vector<Upstream> upstreams_;
+  uint32_t health_check_interval_{30000};
+  uint32_t last_health_check_{0};
+  std::atomic<bool> health_checking_{false};
+
+  int pick_upstream(uint32_t tried) const;
+  FTPSession *claim_slot(uint8_t upstream, int &stale_sock);
+  void mark_upstream(uint8_t index, bool healthy);
+  static void health_check_task(void *arg);
+
+  // Pool de connexions de contrôle réutilisées entre les requêtes
+  uint8_t pool_size_{2};
+  uint32_t idle_timeout_{60000};
+  uint32_t keepalive_interval_{20000};
+  uint32_t last_pool_check_{0};
+  std::atomic<bool> pool_maintaining_{false};
+  bool pool_maintenance_due(uint32_t now);
+  static void keepalive_task(void *arg);
+  std::vector<FTPSession> pool_;
+  Mutex pool_mutex_;
+
+  // Résolution DNS en cache et connexion bornée dans le temps
+  uint32_t connect_timeout_{5000};
+  uint32_t dns_ttl_{300000};
+  Mutex dns_mutex_;
+  std::atomic<bool> dns_refreshing_{false};
+  uint32_t dns_last_attempt_{0};
+
+  bool resolve_server(const Upstream &upstream, ResolvedServer &result);
+  bool server_addresses(uint8_t index, ResolvedServer &result, bool force);
+  static void dns_refresh_task(void *arg);
+  int connect_with_timeout(const struct sockaddr *addr, socklen_t len);
+
+  // FTPS explicite (AUTH TLS, PROT P) ; sans TLS, secure_data() ne fait rien
+#ifdef USE_FTP_HTTP_PROXY_TLS
+  bool tls_verify_{true};
+  mbedtls_ssl_config tls_conf_;
+
+  bool setup_tls();
+  bool start_control_tls(FTPSession &session);
+  bool start_tls(int sock, const std::string &host, const TlsSession *resume, TlsSession *saved);
+#endif
+  bool secure_data(FTPSession &session, int data_sock);
+
+  // Relais : taille et nombre de blocs du tampon circulaire
+  size_t chunk_size_{4096};
+  uint8_t buffer_count_{4};
+
+  // Workers de transfert alimentés par le handler HTTP
+  uint8_t max_concurrent_{2};
+  QueueHandle_t work_queue_{nullptr};
+
+  // Admission : file bornée et délai d'attente maximal, 503 au-delà
+  uint8_t queue_size_{4};
+  uint32_t queue_timeout_{5000};
+  std::atomic<uint32_t> active_{0};
+  std::atomic<uint32_t> rejected_{0};  // file pleine à l'arrivée
+  std::atomic<uint32_t> expired_{0};   // délai dépassé dans la file
+  uint32_t last_admission_report_{0};
+  uint32_t last_rejected_report_{0};
+
+  esp_err_t reject_busy(httpd_req_t *req);
+
+  ProxyMetrics metrics_;
+  bool metrics_endpoint_{false};
+  uint32_t last_sensor_publish_{0};
+#ifdef USE_SENSOR
+  sensor::Sensor *throughput_sensor_{nullptr};
+  sensor::Sensor *first_byte_sensor_{nullptr};
+#endif
+
+  static esp_err_t metrics_handler(httpd_req_t *req);
+
+  // Dernières requêtes en détail, lues sur /trace
+  uint16_t trace_size_{0};
+  TraceRing trace_;
+
+  void trace_request(TraceRecord &record, httpd_req_t *req, const std::string &remote_path);
+  static esp_err_t trace_handler(httpd_req_t *req);
+
+  // Limites de débit (octets/s, 0 : aucune) et priorités par chemin. Les
+  // transferts prioritaires passent devant dans la file et échappent à la
+  // limite globale ; les transferts de masse cèdent le processeur
+  uint32_t client_rate_limit_{0};
+  uint32_t global_rate_limit_{0};
+  std::unique_ptr<TokenBucket> global_bucket_;
+  std::map<std::string, std::shared_ptr<TokenBucket>> client_buckets_;
+  Mutex shaping_mutex_;
+  std::vector<PriorityRule> priority_rules_;
+
+  std::shared_ptr<TokenBucket> client_bucket(const std::string &client);
+  TransferPriority priority_for(const char *path, size_t len) const;
+  static std::string client_address(httpd_req_t *req);
+  static void client_address(httpd_req_t *req, char *text, size_t len);
+
+  // Transferts en cours partagés entre clients, par chemin distant
+  size_t coalesce_buffer_{65536};
+  std::map<std::string, std::shared_ptr<SharedTransfer>> inflight_;
+  Mutex inflight_mutex_;
+
+  // Métadonnées SIZE/MDTM récentes, par chemin distant
+  uint32_t metadata_ttl_{10000};
+  std::map<std::string, MetaEntry> meta_cache_;
+  Mutex meta_mutex_;
+
+  bool meta_lookup(const std::string &remote_path, RemoteFileInfo &info);
+  void meta_store(const std::string &remote_path, const RemoteFileInfo &info);
+  bool get_file_info(const std::string &remote_path, RemoteFileInfo &info);
+
+  // Répertoires listables (et leurs fichiers servis), listings en cache
+  // avec les faits SIZE/MDTM de MLSD
+  std::vector<std::string> listing_dirs_;
+  uint32_t listing_ttl_{30000};
+  std::map<std::string, std::shared_ptr<DirListing>> listings_;
+  Mutex listing_mutex_;
+
+  bool match_listing(const char *path, size_t len) const;
+  std::shared_ptr<DirListing> listing_lookup(const std::string &dir);
+  std::shared_ptr<DirListing> get_listing(const std::string &dir, int *reply = nullptr);
+  bool fetch_listing(const std::string &dir, DirListing &listing, int *reply = nullptr);
+  bool listing_file_info(const std::string &remote_path, RemoteFileInfo &info);
+  bool serve_listing(const std::string &dir, ResponseStream &out, bool head);
+  bool serve_head(const std::string &remote_path, ResponseStream &out);
+  static bool send_error_page(ResponseStream &out, const char *status, bool head);
+  static bool parse_mlsd_line(const std::string &line, DirEntry &entry);
+  static bool parse_list_line(const std::string &line, DirEntry &entry);
+  bool send_not_modified(const std::string &remote_path, const ConditionalRequest &conditional, ResponseStream &out);
+  static void add_validators(const RemoteFileInfo &info, ResponseStream &out, bool compressed = false);
+
+  // Canal de données compressé (MODE Z) quand le serveur le permet
+  bool mode_z_{false};
+
+  int8_t upstream_mode_z(const FTPSession &session);
+
+  // Reprise (REST) d'un téléchargement coupé : délai doublé à chaque essai
+  uint8_t max_retries_{3};
+  uint32_t retry_backoff_{500};
+
+  // Envoi de fichiers par PUT/POST, désactivé par défaut
+  bool allow_upload_{false};
+  size_t upload_chunk_size_{4096};
+
+  bool upload_file(const std::string &remote_path, httpd_req_t *req);
+  bool rename_remote(const std::string &from, const std::string &to);
+  void invalidate_path(const std::string &remote_path);
+
+  // Préchargement des chemins configurés : petits fichiers en RAM, les
+  // autres sur la carte SD, revalidés toutes les refresh_interval
+  bool prefetch_{false};
+  uint32_t refresh_interval_{600000};
+  size_t prefetch_ram_limit_{32768};
+  size_t prefetch_ram_budget_{131072};
+  std::atomic<bool> prefetch_running_{false};
+  uint32_t prefetch_next_{0};
+  std::map<std::string, std::shared_ptr<RamFile>> ram_cache_;
+  size_t ram_used_{0};
+  Mutex ram_mutex_;
+
+  std::shared_ptr<RamFile> ram_lookup(const std::string &remote_path);
+  void ram_mark_validated(const std::string &remote_path);
+  void ram_store(const std::string &remote_path, std::shared_ptr<RamFile> file);
+  void ram_erase(const std::string &remote_path);
+  bool ram_has_room(const std::string &remote_path, size_t size);
+  bool serve_ram_file(const RamFile &file, ResponseStream &out, const ByteRange &range);
+  static void prefetch_task(void *arg);
+  bool prefetch_path(const std::string &remote_path);
+
+  std::shared_ptr<SharedTransfer> coalesce_join(const std::string &remote_path, bool &leader);
+  bool coalesce_start(SharedTransfer &shared, const RemoteFileInfo &info);
+  void coalesce_write(SharedTransfer &shared, const char *data, size_t len);
+  bool coalesce_has_readers(SharedTransfer &shared);
+  void coalesce_complete(SharedTransfer &shared);
+  void coalesce_finish(const std::string &remote_path, SharedTransfer &shared);
+  bool serve_follower(SharedTransfer &shared, SharedReader &reader, ResponseStream &out);
+
+#ifdef USE_FTP_HTTP_PROXY_CACHE
+  // Cache de lecture sur carte SD
+  storage::StorageComponent *storage_{nullptr};
+  std::string cache_dir_{"/ftp_cache"};
+  uint32_t cache_ttl_{300000};
+  std::map<std::string, CacheEntry> cache_index_;
+  Mutex cache_mutex_;
+
+  std::string cache_file_path(const std::string &remote_path, const char *suffix);
+  bool cache_lookup(const std::string &remote_path, CacheEntry &entry);
+  void cache_mark_validated(const std::string &remote_path);
+  void cache_store(const std::string &remote_path, const RemoteFileInfo &info, const std::string &tmp_path);
+  // Fichier temporaire propre à chaque écrivain (téléchargement, préchargement,
+  // segments) : deux écritures simultanées du même chemin ne se mélangent pas
+  std::set<std::string> cache_writers_;
+  std::string cache_temp_acquire(const std::string &remote_path);
+  void cache_temp_release(const std::string &tmp_path);
+  bool serve_cached_file(const std::string &remote_path, const CacheEntry &entry, ResponseStream &out,
+                         const ByteRange &range);
+
+  // Téléchargement segmenté des gros fichiers : une connexion par segment
+  uint8_t segments_{1};
+  size_t segment_min_size_{1048576};
+
+  bool open_segments(const std::string &remote_path, const RemoteFileInfo &info, FTPSession *session, int data_sock,
+                     std::vector<Segment> &segments, std::string &tmp_path);
+  bool fetch_segmented(const std::string &remote_path, const RemoteFileInfo &info, std::vector<Segment> &segments,
+                       const std::string &tmp_path, ResponseStream &out, SharedTransfer *shared,
+                       TransferStats &stats);
+  static void segment_task(void *arg);
+  bool download_segment(Segment &segment);
+
+  // Miroir de répertoires distants sur la carte, comparé à un manifeste
+  // (taille, date, CRC-32 facultatif) : seuls les fichiers modifiés sont
+  // retéléchargés, ceux disparus du serveur sont supprimés
+  std::vector<std::string> mirror_dirs_;
+  std::string mirror_path_{"/ftp_mirror"};
+  uint32_t mirror_interval_{3600000};
+  uint32_t mirror_rate_limit_{0};
+  bool mirror_checksum_{false};
+  bool mirror_xcrc_{true};  // XCRC accepté par le serveur
+  std::atomic<bool> mirror_running_{false};
+  uint32_t mirror_next_{0};
+  bool mirror_loaded_{false};
+  std::map<std::string, MirrorEntry> mirror_manifest_;  // tâche du miroir seulement
+
+  static void mirror_task(void *arg);
+  bool mirror_sync();
+  bool mirror_walk(const std::string &dir, uint8_t depth, std::set<std::string> &seen, TokenBucket *bucket,
+                   bool &changed);
+  bool mirror_fetch(const std::string &remote_path, TokenBucket *bucket, MirrorEntry &result);
+  bool mirror_remote_crc(const std::string &remote_path, uint32_t &crc);
+  void mirror_load_manifest();
+  bool mirror_save_manifest();
+  std::string mirror_local_path(const std::string &remote_path) const { return mirror_path_ + "/" + remote_path; }
+#endif
+
+  bool send_commands(FTPSession &session, const std::string &commands);
+  int read_reply(FTPSession &session, std::string *text = nullptr);
+  int ftp_command(FTPSession &session, const std::string &cmd, std::string *text = nullptr);
+
+  bool connect_to_ftp(FTPSession &session);
+  FTPSession *acquire_session(bool &reused);
+  void release_session(FTPSession *session, bool reusable);
+  void close_session(FTPSession &session);
+  int detach_session(FTPSession &session);
+  bool session_alive(const FTPSession &session);
+  static const char *passive_command(const FTPSession &session);
+  int open_data_connection(FTPSession &session);
+  static std::string stat_commands(const std::string &remote_path);
+  bool read_stat_replies(FTPSession &session, RemoteFileInfo &info);
+
+  bool relay_data(int data_sock, size_t &remaining, const RelaySink &sink);
+  static bool apply_file_info(const RemoteFileInfo &info, const ByteRange &range, ResponseStream &out, size_t &start,
+                              size_t &remaining);
+  bool download_file(const std::string &remote_path, ResponseStream &out, const ByteRange &range,
+                     bool accept_deflate = false, bool coalesce = true);
+  FTPSession *begin_transfer(const std::string &remote_path, RemoteFileInfo *info, int &data_sock,
+                             TraceRecord *trace = nullptr);
+  // rest_refused : si non nul, un REST en 5xx n'est pas une erreur, RETR part de l'octet 0
+  bool send_retr(FTPSession *session, const std::string &remote_path, size_t start, int data_sock,
+                 bool *compressed = nullptr, bool *rest_refused = nullptr);
+  bool end_transfer(FTPSession *session, bool relay_ok, bool truncated);
+  bool fetch_from_ftp(const std::string &remote_path, ResponseStream &out, const ByteRange &range,
+                      SharedTransfer *shared, bool accept_deflate);
+  void report_transfer(const std::string &remote_path, const TransferStats &stats, TraceRecord *trace, bool ok);
   void setup_http_server();
   static esp_err_t http_req_handler(httpd_req_t *req);
+  bool match_route(const char *path, size_t len) const;
+#ifdef FTP_HTTP_PROXY_ASYNC
+  static void worker_task(void *arg);
+#endif
+  esp_err_t process_job(TransferJob &job);
+  esp_err_t serve_job(TransferJob &job, ResponseStream &out);
+  static bool parse_range_header(httpd_req_t *req, ByteRange &range);
+  static bool accepts_deflate(httpd_req_t *req);
+  static void parse_conditional_headers(httpd_req_t *req, ConditionalRequest &conditional);
+  static const char *content_type_for(const std::string &path);
 };
 
 }  // namespace ftp_http_proxy
@@ -121,6 +121,62 @@ size_t StorageComponent::get_file_size(const std::string &path) {
   return 0;
 }
 
+FILE *StorageComponent::open_file_direct(const std::string &path, const char *mode) {
+  std::string full_path = this->root_path_ + path;
+  FILE *file = fopen(full_path.c_str(), mode);
+  if (!file) {
+    ESP_LOGE(TAG, "Failed to open file: %s (errno: %d)", full_path.c_str(), errno);
+  }
+  return file;
+}
+
+bool StorageComponent::preallocate_file_direct(const std::string &path, size_t size) {
+  std::string full_path = this->root_path_ + path;
+  FILE *file = fopen(full_path.c_str(), "wb");
+  if (!file) {
+    ESP_LOGE(TAG, "Failed to create file: %s (errno: %d)", full_path.c_str(), errno);
+    return false;
+  }
+  // Writing the last byte makes FAT allocate the whole cluster chain up front
+  bool ok = size == 0 || (fseek(file, size - 1, SEEK_SET) == 0 && fputc(0, file) != EOF);
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    ESP_LOGE(TAG, "Failed to preallocate %u bytes for %s", (unsigned) size, full_path.c_str());
+    remove(full_path.c_str());
+  }
+  return ok;
+}
+
+bool StorageComponent::rename_file_direct(const std::string &from, const std::string &to) {
+  std::string full_from = this->root_path_ + from;
+  std::string full_to = this->root_path_ + to;
+  // FAT refuses to rename over an existing file
+  remove(full_to.c_str());
+  if (rename(full_from.c_str(), full_to.c_str()) != 0) {
+    ESP_LOGE(TAG, "Failed to rename %s to %s (errno: %d)", full_from.c_str(), full_to.c_str(), errno);
+    return false;
+  }
+  return true;
+}
+
+bool StorageComponent::delete_file_direct(const std::string &path) {
+  std::string full_path = this->root_path_ + path;
+  return remove(full_path.c_str()) == 0;
+}
+
+bool StorageComponent::create_directory_direct(const std::string &path) {
+  std::string full_path = this->root_path_ + path;
+  struct stat st;
+  if (stat(full_path.c_str(), &st) == 0) {
+    return S_ISDIR(st.st_mode);
+  }
+  if (mkdir(full_path.c_str(), 0775) != 0) {
+    ESP_LOGE(TAG, "Failed to create directory: %s (errno: %d)", full_path.c_str(), errno);
+    return false;
+  }
+  return true;
+}
+
 // =====================================================
 // SdImageComponent Implementation  
 // =====================================================
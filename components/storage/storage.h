@@ -66,6 +66,13 @@ class StorageComponent : public Component {
   bool write_file_direct(const std::string &path, const std::vector<uint8_t> &data);
   size_t get_file_size(const std::string &path);
   
+  // Streaming access for files too large to hold in RAM
+  FILE *open_file_direct(const std::string &path, const char *mode);
+  bool preallocate_file_direct(const std::string &path, size_t size);
+  bool rename_file_direct(const std::string &from, const std::string &to);
+  bool delete_file_direct(const std::string &path);
+  bool create_directory_direct(const std::string &path);
+  
   // Getters
   const std::string &get_platform() const { return this->platform_; }
   const std::string &get_root_path() const { return this->root_path_; }